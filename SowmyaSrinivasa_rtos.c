@@ -47,6 +47,11 @@
 #include "wait.h"
 #include <string.h>
 
+// the host port (host/rtos_host.c) builds this file against its own
+// tm4c123gh6pm.h, which defines HOST_PORT and stands in for the hardware
+// addresses, the task frame, the kernel call wrappers and the uDMA start of
+// UART0 tx left out below
+#ifndef HOST_PORT
 // REQUIRED: correct these bitbanding references for the off-board LEDs
 #define BLUE_LED     (*((volatile uint32_t *)(0x42000000 + (0x400253FC-0x40000000)*32 + 2*4))) // on-board blue LED
 #define RED_LED      (*((volatile uint32_t *)(0x42000000 + (0x400043FC-0x40000000)*32 + 2*4))) // off-board red LED
@@ -61,6 +66,7 @@
 #define PUSH_BUTTON3   (*((volatile uint32_t *)(0x42000000 + (0x400063FC-0x40000000)*32 + 7*4)))
 #define PUSH_BUTTON4   (*((volatile uint32_t *)(0x42000000 + (0x400073FC-0x40000000)*32 + 6*4)))
 #define PUSH_BUTTON5   (*((volatile uint32_t *)(0x42000000 + (0x400073FC-0x40000000)*32 + 7*4)))
+#endif
 
 
 //Port masks
@@ -77,22 +83,59 @@
 #define PUSH_BUTTON4_MASK 64
 #define PUSH_BUTTON5_MASK 128
 
+#ifndef HOST_PORT
+// DWT cycle counter
+#define CORE_DEMCR_R        (*((volatile uint32_t *)0xE000EDFC))
+#define DWT_CTRL_R          (*((volatile uint32_t *)0xE0001000))
+#define DWT_CYCCNT_R        (*((volatile uint32_t *)0xE0001004))
+#define CORE_DEMCR_TRCENA   0x01000000
+#define DWT_CTRL_CYCCNTENA  0x00000001
+#endif
 
 
 extern void setASP(uint8_t);
 extern void setPSP(void *);
 extern void *getPSP(void);
-extern void pushReglist();
-extern void popReglist();
-extern void createHWpushContext(int temp_xpsr, void *sp);
 extern void *getSVCnumber();
 extern int getR0();
 
+// kernel calls used by the shell before they are defined
+void yield();
+void sleep(uint32_t tick);
+void wait(int8_t s);
+void post(int8_t s);
+uint8_t readPbs();
+void waitFlags(uint8_t group, uint32_t mask, uint8_t options, uint32_t *result);
+void uartPutc(char c);
+void uartPuts(const char *s);
+extern uint32_t atomicReserve(volatile uint32_t *head, uint32_t n, uint32_t tail, uint32_t size);
+extern void pendSVDone();
+
 #define DEBUG
-char str[30];
+#define BENCHMARK
+//#define TRACE
+
+// deferred log: call sites store an id and raw arguments, the Logger task
+// sends them as binary frames and tools/logdecode.py formats them on the host
+// the decoder reads the format strings from the comments below, one per line
+// and with %u/%x/%d conversions only
+#define LOG_DROPPED     1   // "%u log records dropped"
+#define LOG_CREATE      2   // "thread %u created, pid %u, stack 0x%08x-0x%08x"
+#define LOG_NO_STACK    3   // "no stack of %u bytes for a new thread"
+#define LOG_DESTROY     4   // "thread %u destroyed"
+#define LOG_RESTART     5   // "thread %u restarted, pid %u"
+#define LOG_MPU_FAULT   6   // "MPU fault in thread %u at 0x%08x, status 0x%02x, killed"
+#define LOG_USAGE_FAULT 7   // "usage fault in thread %u, status 0x%04x, killed"
+#define LOG(id)             logWrite(id, 0, 0, 0, 0, 0)
+#define LOG1(id, a)         logWrite(id, 1, a, 0, 0, 0)
+#define LOG2(id, a, b)      logWrite(id, 2, a, b, 0, 0)
+#define LOG3(id, a, b, c)   logWrite(id, 3, a, b, c, 0)
+#define LOG4(id, a, b, c, d) logWrite(id, 4, a, b, c, d)
 
 #define PR         1
 #define RR         2
+#define EDF        3       // periodic tasks by earliest deadline, then PR
+#define RM         4       // PR with periodic tasks ranked by period
 #define DELIMETER 'd'
 #define ALPHA     'a'
 #define NUMBER    'n'
@@ -109,11 +152,29 @@ typedef struct _USER_DATA
     char fieldType[MAX_FIELDS];
 } USER_DATA;
 
-// UI message variables
-#define UI_BUFFER_LENGTH 30
-char UImessage[UI_BUFFER_LENGTH];
-uint8_t rxIndex = 0;
-uint8_t txIndex = 0;
+// UART0 rx ring filled by uart0ISR, size is a power of two
+// head is where the next character goes in, tail where the next one comes out
+#define UART_RX_SIZE 128
+char uartRx[UART_RX_SIZE];
+volatile uint16_t rxHead = 0, rxTail = 0;
+volatile uint8_t rxLines = 0;   // complete lines waiting in the rx ring
+
+// UART0 tx: ping-pong buffers, writers append to one while uDMA channel 9
+// sends the other, each buffer goes out as a single transfer
+#define UART_TX_SIZE 256
+#define UART_TX_DMA_CH 9
+char uartTx[2][UART_TX_SIZE];
+volatile uint16_t txCount[2];   // bytes in each buffer
+volatile uint8_t txFill = 0;    // buffer writers append to
+volatile bool txBusy = false;   // uDMA is sending the other buffer
+
+// uDMA control table, primary structures of channels 0-31, 1 KiB aligned
+#if defined(__TI_COMPILER_VERSION__)
+#pragma DATA_ALIGN(dmaTable, 1024)
+uint32_t dmaTable[128];
+#else
+uint32_t dmaTable[128] __attribute__((aligned(1024)));
+#endif
 
 
 
@@ -125,21 +186,103 @@ uint8_t txIndex = 0;
 // function pointer
 typedef void (*fn)();
 
+// wait queue: intrusive list threaded through the tcb, any number of waiters
+#define QUEUE_FIFO      0          // wake in arrival order
+#define QUEUE_PRIORITY  1          // wake highest priority first, FIFO within a level
+typedef struct _waitQueue
+{
+    uint8_t head;                  // first task to wake or NO_TASK
+    uint8_t tail;                  // last task to wake or NO_TASK
+    uint8_t size;                  // number of waiting tasks
+    uint8_t order;                 // QUEUE_FIFO or QUEUE_PRIORITY
+} waitQueue;
+
 // semaphore
-#define MAX_SEMAPHORES 5
-#define MAX_QUEUE_SIZE 2
+#define MAX_SEMAPHORES 8
 typedef struct _semaphore
 {
     uint16_t count;
-    uint16_t queueSize;
-    uint32_t processQueue[MAX_QUEUE_SIZE]; // store task index here
+    waitQueue queue;               // tasks blocked in wait()
 } semaphore;
 
 semaphore semaphores[MAX_SEMAPHORES];
-#define keyPressed 1
-#define keyReleased 2
 #define flashReq 3
-#define resource 4
+#define benchStart 4
+#define benchDone 5
+#define benchPing 6
+#define benchPong 7
+
+// mutex with an owner and priority inheritance or priority ceiling
+#define MAX_MUTEXES 2
+#define NO_MUTEX 0xFF
+#define MUTEX_INHERIT 0            // owner runs at the priority of its best waiter
+#define MUTEX_CEILING 1            // owner runs at the ceiling while it holds the lock
+typedef struct _mutex
+{
+    uint8_t owner;                 // task holding the lock or NO_TASK
+    uint8_t protocol;              // MUTEX_INHERIT or MUTEX_CEILING
+    uint8_t ceiling;               // priority of the highest user, MUTEX_CEILING only
+    uint16_t errors;               // refused recursive locks and unlocks by non owners
+    waitQueue queue;               // tasks blocked on the lock
+} mutex;
+
+mutex mutexes[MAX_MUTEXES];
+#define resource 0
+
+// fixed-block buffer pool, messages are pointers to these buffers and the
+// buffer belongs to one task at a time: getBuffer -> send -> receive -> freeBuffer
+#define BUFFER_COUNT  8
+#define BUFFER_SIZE   64           // bytes, multiple of 4
+#define NO_BUFFER     0xFF
+#define BUFFER_QUEUED 0xFE         // owner of a buffer sitting in a mailbox
+uint32_t bufferPool[BUFFER_COUNT][BUFFER_SIZE / 4];
+uint8_t bufferOwner[BUFFER_COUNT]; // task holding each buffer, NO_TASK when free
+uint8_t bufferNext[BUFFER_COUNT];  // free list links
+uint8_t bufferFree;                // first free buffer or NO_BUFFER
+uint16_t bufferErrors;             // frees of buffers the caller did not own
+waitQueue bufferQueue;             // tasks blocked in getBuffer()
+
+// mailbox: bounded queue of buffer pointers with blocking send and receive
+#define MAX_MAILBOXES 4
+#define MAILBOX_DEPTH 4
+typedef struct _mailbox
+{
+    void *msg[MAILBOX_DEPTH];      // circular queue of messages
+    uint8_t head;                  // oldest message
+    uint8_t count;                 // messages queued
+    uint16_t errors;               // sends of buffers the caller did not own
+    waitQueue senders;             // tasks blocked in send() on a full mailbox
+    waitQueue receivers;           // tasks blocked in receive() on an empty mailbox
+} mailbox;
+
+mailbox mailboxes[MAX_MAILBOXES];
+
+// event flag group: 32 flags, tasks block until any or all bits of a mask are set
+#define MAX_FLAG_GROUPS 4
+#define FLAGS_ANY   0              // wake when any bit of the mask is set
+#define FLAGS_ALL   1              // wake when every bit of the mask is set
+#define FLAGS_CLEAR 2              // or'ed in: clear the mask bits that woke the task
+typedef struct _flagGroup
+{
+    uint32_t flags;
+    waitQueue queue;               // tasks blocked in waitFlags()
+} flagGroup;
+
+flagGroup flagGroups[MAX_FLAG_GROUPS];
+#define buttonFlags 0
+#define uartFlags   1
+#define UART_LINE     1            // a line ended in the rx ring
+#define UART_TX_SPACE 2            // a tx buffer finished sending
+
+// pushbuttons: an edge masks the button interrupts and starts the debounce
+// timer, when it expires the stable state is compared with the last one and
+// presses are set in buttonFlags (bit n for button n), releases only update
+// the state since nothing waits for them
+#define DEBOUNCE_TICKS 20
+#define BUTTON_PRESS(n)   (1 << (n))
+#define BUTTON_PRESSES    0x3F
+uint32_t debounceTicks = 0;    // ticks until the buttons are sampled, 0 when idle
+uint8_t buttonState = 0;       // last debounced readPbs() value
 
 // task
 #define STATE_INVALID    0 // no task
@@ -148,32 +291,185 @@ semaphore semaphores[MAX_SEMAPHORES];
 #define STATE_DELAYED    3 // has run, but now awaiting timer
 #define STATE_BLOCKED    4 // has run, but now blocked by semaphore
 #define STATE_HOLD       5 // supports kill command
+#define STATE_THROTTLED  6 // used up its CPU budget, waiting for replenishment
 
 #define MAX_TASKS 12       // maximum number of valid tasks
 uint8_t taskCurrent = 0;   // index of last dispatched task
 uint8_t taskCount = 0;     // total number of valid tasks
 uint32_t pidCounter = 0;   // incremented on each thread created
+bool rtosStarted = false;  // tasks are running and may block
 #define MAX_PRIORITIES 8
+#define NO_TASK 0xFF       // empty list link
+
+// ready lists: one circular list per priority, bitmap of non-empty levels
+// bit (31 - priority) is set so count leading zeros gives the highest level
+#define PRIORITY_BIT(p) (0x80000000 >> (p))
+uint32_t readyBitmap = 0;
+uint8_t readyHead[MAX_PRIORITIES];  // next task to dispatch at each level
+
+// sleeping tasks: delta list sorted by wake time, each entry holds the
+// ticks remaining after the entry before it so the tick only touches the head
+uint8_t sleepHead = NO_TASK;
+
+#if defined(__TI_COMPILER_VERSION__)
+#define CLZ(x) _norm(x)
+#else
+#define CLZ(x) __builtin_clz(x)
+#endif
 
-uint32_t *heap = (uint32_t*) 0x20002000;// question : why do we need to do x*4?
-uint32_t allocated_heap = 0;
+// extra stack for a task using the FPU: S0-S15, FPSCR and a reserved word in
+// the hardware frame plus S16-S31 saved by pendSVIsr
+#define FPU_CONTEXT_BYTES (34 * 4)
+
+// thread stacks: 1 KiB pages from 0x20002000 to the end of SRAM, handed out
+// as power-of-two blocks aligned to their own size so each one can be an
+// MPU region, and returned to the pool when the thread is destroyed
+#define HEAP_BASE  0x20002000
+#ifndef HEAP_END
+#define HEAP_END   0x20008000          // the host port maps a larger pool
+#endif
+#define PAGE_SIZE  1024
+#define HEAP_PAGES ((HEAP_END - HEAP_BASE) / PAGE_SIZE)
+uint8_t pageOwner[HEAP_PAGES];     // task using each page or NO_TASK
+uint8_t stackReclaim = NO_TASK;    // task that destroyed itself, its stack is freed once switched away
+
+// MPU region 7 covers the stack block of the running task, only its lowest
+// subregion (1/8 of the block) is enabled, with no access, as a guard
+// everything else keeps the default memory map (PRIVDEFEN)
+#define STACK_REGION 7
+#define GUARD_SRD    (0xFE << 8)       // disable subregions 1-7
+#define GUARD_BYTES(size) ((size) >> 3)
+
+// exception priorities (0 highest), the faults keep 0 so they preempt the kernel
+#define KERNEL_PRIORITY   1
+#define EXC_RETURN_THREAD 0x00000008   // EXC_RETURN bit 3, the fault came from a task
+
+// stacks are painted when a thread is (re)started, idle later finds how far
+// down the paint has been overwritten
+#define STACK_PAINT  0xA5A5A5A5
 
 //#define DEBUG
 
+// SVC numbers, tools/trace2chrome.py names them in SVC_NAMES
 #define YIELD 16
 #define SLEEP 32
 #define POST  64
 #define WAIT  128
+#define LOCK   17
+#define UNLOCK 18
+#define GETBUF  19
+#define FREEBUF 20
+#define SEND    21
+#define RECEIVE 22
+#define WAITFLAGS 23
+#define SETFLAGS  24
+#define SLEEPUNTIL 25
 
 //-----------------------------------------------------------------------------
 // Globals
 //-----------------------------------------------------------------------------
 
+// log ring in words, a record is a header, the tick and up to 4 arguments
+// header: bit 31 set, task in 23:16, id in 15:8, argument count in 3:0
+// the header is written last so a zero header is a record still being written
+#define LOG_SIZE   256
+#define LOG_SYNC   0xA5             // first byte of a frame on the UART
+#define LOG_PERIOD 20               // ms between Logger passes
+uint32_t logRing[LOG_SIZE];
+volatile uint32_t logHead = 0;      // free running word counts
+volatile uint32_t logTail = 0;
+volatile uint32_t logDropped = 0;
+
 
 bool preemption = true;
 uint8_t scheduler = PR;
-uint32_t taskCycle[2][MAX_TASKS];
-uint8_t bufferBlock;
+
+// run time accounting from the free running DWT cycle counter
+// cycles go to the running task at every switch, every cpuWindow ticks the
+// counts are latched for ps/top and restarted
+uint32_t switchStamp;              // CYCCNT at the last switch or window end
+uint32_t cpuWindow = 1000;         // ticks per CPU usage window
+uint32_t windowStart;              // tickCount when the window began
+uint32_t windowTotal;              // cycles in the last complete window
+uint32_t semBlockedUs[MAX_TASKS][MAX_SEMAPHORES]; // time each task waited on each semaphore
+bool switchYield = false;          // the pending switch was asked for by yield()
+
+// set when a task became ready that may run before the current one or the
+// current one's slice ran out, interrupts only pend PendSV when it is set
+bool rescheduleNeeded = false;
+uint8_t taskNext;                  // chosen by scheduleNext for taskSwitch
+
+// time slice in ticks for each priority level, a task's own quantum overrides it
+uint8_t priorityQuantum[MAX_PRIORITIES] = {1, 1, 1, 1, 1, 1, 1, 1};
+
+// CPU budgets: a task with a budget may run that many ticks per budget period,
+// when it runs out it is demoted to background or held until the period ends
+#define BUDGET_DEMOTE 0
+#define BUDGET_HOLD   1
+#define BACKGROUND_PRIORITY (MAX_PRIORITIES - 1)
+uint8_t budgetTasks = 0;           // tasks with a budget
+uint32_t nextReplenish;            // earliest replenishAt among them
+
+// tickless idle
+#define TICK_CYCLES 40000                           // 1ms at 40 MHz
+#define MAX_IDLE_TICKS (0xFFFFFF / TICK_CYCLES)     // longest 24-bit SysTick period
+bool tickless = true;
+uint32_t tickCount = 0;        // kernel ticks since power up
+uint32_t suppressedTicks = 0;  // ticks skipped while idle was asleep
+
+#ifdef BENCHMARK
+// benchmark paths, timed in DWT cycles by the benchMaster task
+#define BENCH_YIELD        0   // yield() round trip through the partner
+#define BENCH_PENDSV       1   // PendSV switch to a READY task
+#define BENCH_UNRUN        2   // PendSV switch to an UNRUN task
+#define BENCH_PINGPONG     3   // post() -> wait() round trip
+#define BENCH_TICK         4   // SysTick entry to first instruction of woken task
+#define BENCH_TESTS        5   // no test running, partner parked on benchPing
+#define BENCH_MAX_SAMPLES  512 // enough for a p99 that is not just the max
+typedef struct _benchStats
+{
+    uint32_t min;
+    uint32_t avg;
+    uint32_t max;
+    uint32_t p99;
+} benchStats;
+const char *benchNames[BENCH_TESTS] = {"yield round trip", "pendSV to READY", "pendSV to UNRUN",
+                                       "post/wait pingpong", "tick to task"};
+uint8_t benchMode = BENCH_TESTS;
+uint16_t benchIterations = 500;
+uint32_t benchStartCycles;     // stamp taken just before the timed path
+uint32_t benchTickCycles;      // stamp taken on SysTick entry
+uint32_t benchSample;          // cycles seen by the partner when it resumes
+uint16_t benchSamples[BENCH_MAX_SAMPLES]; // cycles, saturated at 0xFFFF
+benchStats benchResults[BENCH_TESTS];
+void benchPartner();
+#endif
+
+#ifdef TRACE
+// flight recorder of kernel events stamped with CYCCNT, the oldest entries
+// are overwritten, only written from handlers at the kernel priority
+// the trace command dumps it and tools/trace2chrome.py makes a timeline
+#define TRACE_SWITCH  0    // task = outgoing, arg = incoming
+#define TRACE_SVC     1    // task = caller, arg = SVC number
+#define TRACE_BLOCK   2    // task blocked on semaphore arg
+#define TRACE_UNBLOCK 3    // task woken by a post to semaphore arg
+#define TRACE_TICK    4    // task = running task
+#define TRACE_SIZE    256
+typedef struct _traceEntry
+{
+    uint32_t time;
+    uint8_t type;
+    uint8_t task;
+    uint8_t arg;
+} traceEntry;
+traceEntry traceRing[TRACE_SIZE];
+uint16_t traceNext = 0;            // entry written next
+uint16_t traceCount = 0;           // valid entries, up to TRACE_SIZE
+bool traceOn = true;               // off while the shell dumps the ring
+#define TRACE_EVENT(type, task, arg) traceEvent(type, task, arg)
+#else
+#define TRACE_EVENT(type, task, arg)
+#endif
 
 
 // REQUIRED: add store and management for the memory used by the thread stacks
@@ -186,10 +482,59 @@ struct _tcb
     fn pFn;                        // function pointer
     void *spInit;                  // original top of stack
     void *sp;                      // current stack pointer
-    int8_t priority;               // 0=highest to 7=lowest
-    uint32_t ticks;                // ticks until sleep complete
+    int8_t priority;               // 0=highest to 7=lowest, raised by mutex inheritance
+    int8_t basePriority;           // priority assigned to the task
+    uint32_t ticks;                // ticks until sleep complete, after the previous sleeper
     char name[16];                 // name of task used in ps command
     uint8_t s;                     // index of semaphore that is blocking the thread
+    uint8_t readyNext;             // next task in ready list (NO_TASK if not ready)
+    uint8_t readyPrev;             // previous task in ready list
+    uint8_t sleepNext;             // next task in sleep delta list
+    bool fpu;                      // may use the FPU, its stack has room for the context
+    void *stack;                   // base of the stack block, 0 when returned to the pool
+    uint32_t stackSize;            // bytes in the stack block
+    uint32_t mpuBase;              // RBAR value for the stack guard region
+    uint32_t mpuAttr;              // RASR value for the stack guard region
+    uint32_t stackPeak;            // most stack bytes ever used, updated by idle
+    uint32_t cycles;               // cycles run in the current window
+    uint32_t windowCycles;         // cycles run in the last complete window
+    uint32_t switches;             // times switched in
+    uint32_t voluntary;            // switched out after blocking, sleeping or yielding
+    uint32_t preempted;            // switched out while still ready
+    uint32_t readyStamp;           // CYCCNT when it last became ready
+    uint32_t worstLatency;         // most cycles from ready to running
+    bool timedWake;                // released by sleepUntil, not yet running
+    uint32_t releases;             // sleepUntil releases
+    uint32_t jitterWorstUs;        // most time from intended release to running
+    uint32_t jitterTotalUs;        // sum of release jitter for the average
+    uint32_t blockStamp;           // CYCCNT when it blocked on a semaphore
+    uint8_t userPriority;          // priority given at creation, RM overrides the base
+    uint32_t period;               // ticks between releases, 0 for aperiodic tasks
+    uint32_t deadline;             // ticks from release to deadline
+    uint32_t wcet;                 // declared worst case ticks per job
+    uint32_t absDeadline;          // tick the current job is due
+    uint32_t deadlineMisses;       // jobs that finished, or were caught running, late
+    bool jobDone;                  // the last job finished, the next wake releases one
+    bool late;                     // the current job was already counted as a miss
+    uint8_t quantum;               // slice in ticks, 0 for the priority level's
+    uint8_t sliceLeft;             // ticks left in the current slice
+    uint32_t slices;               // slices started
+    uint32_t budget;               // ticks per budget period, 0 for no limit
+    uint32_t budgetPeriod;         // ticks between replenishments
+    uint32_t budgetLeft;           // ticks left in this period
+    uint32_t replenishAt;          // tick the budget is refilled
+    uint8_t budgetAction;          // BUDGET_DEMOTE or BUDGET_HOLD
+    bool demoted;                  // at background priority until replenished
+    uint32_t overruns;             // periods in which the budget ran out
+    void **msgDest;                // where a blocked receive() or getBuffer() gets its buffer
+    void *msgOut;                  // buffer held by a blocked send()
+    uint32_t flagMask;             // bits a blocked waitFlags() is waiting for
+    uint8_t flagOptions;           // FLAGS_ANY or FLAGS_ALL, maybe with FLAGS_CLEAR
+    uint32_t *flagResult;          // where waitFlags() returns the bits that matched
+    uint8_t waitNext;              // next task in the wait queue
+    uint8_t waitPrev;              // previous task in the wait queue
+    waitQueue *queue;              // wait queue the task is blocked in, 0 if none
+    uint8_t mutexWait;             // mutex the task is blocked on or NO_MUTEX
 } tcb[MAX_TASKS];
 
 //-----------------------------------------------------------------------------
@@ -207,16 +552,773 @@ void initRtos()
     {
         tcb[i].state = STATE_INVALID;
         tcb[i].pFn = 0;
+        tcb[i].readyNext = NO_TASK;
+    }
+    for (i = 0; i < MAX_SEMAPHORES; i++)
+    {
+        semaphores[i].queue.head = NO_TASK;
+        semaphores[i].queue.tail = NO_TASK;
+    }
+    for (i = 0; i < MAX_MUTEXES; i++)
+    {
+        mutexes[i].owner = NO_TASK;
+        mutexes[i].queue.head = NO_TASK;
+        mutexes[i].queue.tail = NO_TASK;
+        mutexes[i].queue.order = QUEUE_PRIORITY;
+    }
+    for (i = 0; i < MAX_MAILBOXES; i++)
+    {
+        mailboxes[i].senders.head = NO_TASK;
+        mailboxes[i].senders.tail = NO_TASK;
+        mailboxes[i].receivers.head = NO_TASK;
+        mailboxes[i].receivers.tail = NO_TASK;
+    }
+    for (i = 0; i < MAX_FLAG_GROUPS; i++)
+    {
+        flagGroups[i].flags = 0;
+        flagGroups[i].queue.head = NO_TASK;
+        flagGroups[i].queue.tail = NO_TASK;
+    }
+    // every buffer starts on the free list
+    for (i = 0; i < BUFFER_COUNT; i++)
+    {
+        bufferOwner[i] = NO_TASK;
+        bufferNext[i] = (i + 1 < BUFFER_COUNT) ? i + 1 : NO_BUFFER;
+    }
+    bufferFree = 0;
+    bufferQueue.head = NO_TASK;
+    bufferQueue.tail = NO_TASK;
+    // no ready tasks at any level
+    readyBitmap = 0;
+    for (i = 0; i < MAX_PRIORITIES; i++)
+    {
+        readyHead[i] = NO_TASK;
+    }
+    sleepHead = NO_TASK;
+    for (i = 0; i < HEAP_PAGES; i++)
+    {
+        pageOwner[i] = NO_TASK;
+    }
+}
+
+// add task to the tail of the ready list for its priority
+void readyInsert(uint8_t task)
+{
+    uint8_t level = tcb[task].priority;
+    uint8_t head = readyHead[level];
+    if (tcb[task].readyNext != NO_TASK)
+        return;
+    tcb[task].readyStamp = DWT_CYCCNT_R;
+    // an equal priority task waits for the running one's slice to run out
+    if (scheduler == RR || scheduler == EDF || level < tcb[taskCurrent].priority
+            || (level == tcb[taskCurrent].priority && tcb[taskCurrent].sliceLeft == 0))
+        rescheduleNeeded = true;
+    // waking after its last job finished releases the next job of a periodic task
+    if (tcb[task].jobDone)
+    {
+        tcb[task].jobDone = false;
+        tcb[task].late = false;
+        tcb[task].absDeadline = tickCount + tcb[task].deadline;
+    }
+    if (head == NO_TASK)
+    {
+        tcb[task].readyNext = task;
+        tcb[task].readyPrev = task;
+        readyHead[level] = task;
+        readyBitmap |= PRIORITY_BIT(level);
+    }
+    else
+    {
+        tcb[task].readyNext = head;
+        tcb[task].readyPrev = tcb[head].readyPrev;
+        tcb[tcb[head].readyPrev].readyNext = task;
+        tcb[head].readyPrev = task;
+    }
+}
+
+// move the head of a level past task when task is the head, the next task at
+// that level runs next
+void readyRotate(uint8_t task)
+{
+    uint8_t level = tcb[task].priority;
+    if (tcb[task].readyNext != NO_TASK && readyHead[level] == task)
+        readyHead[level] = tcb[task].readyNext;
+}
+
+// take task off the ready list for its priority
+void readyRemove(uint8_t task)
+{
+    uint8_t level = tcb[task].priority;
+    if (tcb[task].readyNext == NO_TASK)
+        return;
+    if (tcb[task].readyNext == task)
+    {
+        readyHead[level] = NO_TASK;
+        readyBitmap &= ~PRIORITY_BIT(level);
+    }
+    else
+    {
+        tcb[tcb[task].readyPrev].readyNext = tcb[task].readyNext;
+        tcb[tcb[task].readyNext].readyPrev = tcb[task].readyPrev;
+        if (readyHead[level] == task)
+            readyHead[level] = tcb[task].readyNext;
+    }
+    tcb[task].readyNext = NO_TASK;
+}
+
+// add task to the sleep delta list to wake after ticks
+void sleepInsert(uint8_t task, uint32_t ticks)
+{
+    uint8_t prev = NO_TASK;
+    uint8_t next = sleepHead;
+    // walk past everyone waking no later than this task
+    while (next != NO_TASK && tcb[next].ticks <= ticks)
+    {
+        ticks -= tcb[next].ticks;
+        prev = next;
+        next = tcb[next].sleepNext;
+    }
+    tcb[task].ticks = ticks;
+    tcb[task].sleepNext = next;
+    if (next != NO_TASK)
+        tcb[next].ticks -= ticks;
+    if (prev == NO_TASK)
+        sleepHead = task;
+    else
+        tcb[prev].sleepNext = task;
+}
+
+// take a sleeping task off the delta list, handing its ticks to the next one
+void sleepRemove(uint8_t task)
+{
+    uint8_t prev = NO_TASK;
+    uint8_t next = sleepHead;
+    while (next != NO_TASK && next != task)
+    {
+        prev = next;
+        next = tcb[next].sleepNext;
+    }
+    if (next == NO_TASK)
+        return;
+    next = tcb[task].sleepNext;
+    if (next != NO_TASK)
+        tcb[next].ticks += tcb[task].ticks;
+    if (prev == NO_TASK)
+        sleepHead = next;
+    else
+        tcb[prev].sleepNext = next;
+    tcb[task].ticks = 0;
+}
+
+// add a blocked task to a wait queue, at the tail for FIFO order or behind
+// every task of equal or higher priority for priority order
+void queueInsert(waitQueue *queue, uint8_t task)
+{
+    uint8_t prev;
+    uint8_t next = NO_TASK;
+    if (queue->order == QUEUE_PRIORITY)
+    {
+        next = queue->head;
+        while (next != NO_TASK && tcb[next].priority <= tcb[task].priority)
+        {
+            next = tcb[next].waitNext;
+        }
+    }
+    if (next == NO_TASK)
+    {
+        prev = queue->tail;
+        queue->tail = task;
+    }
+    else
+    {
+        prev = tcb[next].waitPrev;
+        tcb[next].waitPrev = task;
+    }
+    if (prev == NO_TASK)
+        queue->head = task;
+    else
+        tcb[prev].waitNext = task;
+    tcb[task].waitNext = next;
+    tcb[task].waitPrev = prev;
+    tcb[task].queue = queue;
+    queue->size++;
+}
+
+// unlink a task from the wait queue it is blocked in
+void queueRemove(waitQueue *queue, uint8_t task)
+{
+    if (tcb[task].waitPrev == NO_TASK)
+        queue->head = tcb[task].waitNext;
+    else
+        tcb[tcb[task].waitPrev].waitNext = tcb[task].waitNext;
+    if (tcb[task].waitNext == NO_TASK)
+        queue->tail = tcb[task].waitPrev;
+    else
+        tcb[tcb[task].waitNext].waitPrev = tcb[task].waitPrev;
+    tcb[task].queue = 0;
+    queue->size--;
+}
+
+// take the first task off a wait queue, NO_TASK if it is empty
+uint8_t queuePop(waitQueue *queue)
+{
+    uint8_t task = queue->head;
+    if (task != NO_TASK)
+        queueRemove(queue, task);
+    return task;
+}
+
+// index of a pool buffer, NO_BUFFER for a pointer that is not the start of one
+uint8_t bufferIndex(void *buffer)
+{
+    uint32_t offset = (uint8_t *)buffer - (uint8_t *)bufferPool;
+    if (offset >= sizeof(bufferPool) || offset % BUFFER_SIZE != 0)
+        return NO_BUFFER;
+    return offset / BUFFER_SIZE;
+}
+
+// give a buffer back, straight to the first task waiting for one if any
+void bufferRelease(uint8_t b)
+{
+    uint8_t task = queuePop(&bufferQueue);
+    if (task != NO_TASK)
+    {
+        bufferOwner[b] = task;
+        *tcb[task].msgDest = bufferPool[b];
+        tcb[task].state = STATE_READY;
+        readyInsert(task);
+    }
+    else
+    {
+        bufferOwner[b] = NO_TASK;
+        bufferNext[b] = bufferFree;
+        bufferFree = b;
     }
 }
 
+// append a message to a mailbox that has room, the mailbox now owns the buffer
+void mailboxPut(uint8_t box, void *msg)
+{
+    mailbox *mb = &mailboxes[box];
+    mb->msg[(mb->head + mb->count) % MAILBOX_DEPTH] = msg;
+    mb->count++;
+    bufferOwner[bufferIndex(msg)] = BUFFER_QUEUED;
+}
+
+// true if the flags satisfy a wait for mask with the given options
+bool flagsMatch(uint32_t flags, uint32_t mask, uint8_t options)
+{
+    if (options & FLAGS_ALL)
+        return (flags & mask) == mask;
+    return (flags & mask) != 0;
+}
+
+// set bits in a group and wake every waiter they satisfy in one pass over the
+// queue, every waiter sees the same flags and clear-on-exit bits are taken
+// off after the pass, returns true if a task was woken
+bool flagsSet(uint8_t group, uint32_t mask)
+{
+    flagGroup *g = &flagGroups[group];
+    uint32_t clear = 0;
+    uint8_t task, next;
+    bool woken = false;
+    g->flags |= mask;
+    for (task = g->queue.head; task != NO_TASK; task = next)
+    {
+        next = tcb[task].waitNext;
+        if (flagsMatch(g->flags, tcb[task].flagMask, tcb[task].flagOptions))
+        {
+            queueRemove(&g->queue, task);
+            *tcb[task].flagResult = g->flags & tcb[task].flagMask;
+            if (tcb[task].flagOptions & FLAGS_CLEAR)
+                clear |= tcb[task].flagMask;
+            tcb[task].state = STATE_READY;
+            readyInsert(task);
+            woken = true;
+        }
+    }
+    g->flags &= ~clear;
+    return woken;
+}
+
+// a task waiting on semaphore s is woken, add the wait to its blocked time
+void semaphoreWaited(uint8_t task, uint8_t s)
+{
+    semBlockedUs[task][s] += (DWT_CYCCNT_R - tcb[task].blockStamp) / 40;
+}
+
+// ticks a task may run before giving way to another task at its level
+uint8_t taskQuantum(uint8_t task)
+{
+    return tcb[task].quantum ? tcb[task].quantum : priorityQuantum[tcb[task].priority];
+}
+
+// latch the cycles of the window that just ended for ps and top
+void cpuWindowEnd()
+{
+    uint32_t now = DWT_CYCCNT_R;
+    uint8_t i;
+    tcb[taskCurrent].cycles += now - switchStamp;
+    switchStamp = now;
+    windowTotal = 0;
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        tcb[i].windowCycles = tcb[i].cycles;
+        tcb[i].cycles = 0;
+        windowTotal += tcb[i].windowCycles;
+    }
+    windowStart = tickCount;
+}
+
+// set the running priority of a task, keeping the ready list or priority
+// ordered wait queue it sits in sorted
+void changePriority(uint8_t task, uint8_t priority)
+{
+    waitQueue *queue = tcb[task].queue;
+    if (tcb[task].priority == priority)
+        return;
+    if (tcb[task].readyNext != NO_TASK)
+    {
+        // moving between levels is not a new wait for latency purposes
+        uint32_t stamp = tcb[task].readyStamp;
+        readyRemove(task);
+        tcb[task].priority = priority;
+        readyInsert(task);
+        tcb[task].readyStamp = stamp;
+    }
+    else if (queue != 0 && queue->order == QUEUE_PRIORITY)
+    {
+        queueRemove(queue, task);
+        tcb[task].priority = priority;
+        queueInsert(queue, task);
+    }
+    else
+    {
+        tcb[task].priority = priority;
+    }
+}
+
+// priority a task is entitled to: its own, the ceiling of ceiling mutexes it
+// holds and the priority of the best task waiting on any mutex it holds
+uint8_t mutexPriority(uint8_t task)
+{
+    uint8_t i, head;
+    uint8_t priority = tcb[task].demoted ? BACKGROUND_PRIORITY : tcb[task].basePriority;
+    for (i = 0; i < MAX_MUTEXES; i++)
+    {
+        if (mutexes[i].owner == task)
+        {
+            head = mutexes[i].queue.head;
+            if (mutexes[i].protocol == MUTEX_CEILING && mutexes[i].ceiling < priority)
+                priority = mutexes[i].ceiling;
+            if (head != NO_TASK && tcb[head].priority < priority)
+                priority = tcb[head].priority;
+        }
+    }
+    return priority;
+}
+
+// recompute the priority of a task and of the chain of owners it is blocked
+// behind, raising them on a new waiter and restoring them when one leaves
+void propagatePriority(uint8_t task)
+{
+    while (task != NO_TASK)
+    {
+        changePriority(task, mutexPriority(task));
+        if (tcb[task].mutexWait == NO_MUTEX)
+            break;
+        task = mutexes[tcb[task].mutexWait].owner;
+    }
+}
+
+// hand a mutex to its best waiter, or free it, and drop any priority the old
+// owner inherited through it
+void mutexRelease(uint8_t m)
+{
+    uint8_t owner = mutexes[m].owner;
+    uint8_t next = queuePop(&mutexes[m].queue);
+    mutexes[m].owner = next;
+    if (next != NO_TASK)
+    {
+        tcb[next].mutexWait = NO_MUTEX;
+        tcb[next].state = STATE_READY;
+        tcb[next].priority = mutexPriority(next);
+        readyInsert(next);
+    }
+    changePriority(owner, mutexPriority(owner));
+}
+
+// a sleepUntil release reached the cpu cycles after its intended tick
+void releaseJitter(uint8_t task, uint32_t cycles)
+{
+    uint32_t us = cycles / 40;
+    tcb[task].timedWake = false;
+    tcb[task].releases++;
+    tcb[task].jitterTotalUs += us;
+    if (us > tcb[task].jitterWorstUs)
+        tcb[task].jitterWorstUs = us;
+}
+
+// charge the tick to the running task's budget, on overrun demote it to
+// background or take it off the ready lists until its replenishment
+// returns true when the task has to give up the cpu now, even when
+// preemption is off, an uncooperative task is what budgets are there for
+bool budgetCharge(uint8_t task)
+{
+    if (tcb[task].budget == 0 || tcb[task].budgetLeft == 0)
+        return false;
+    if (--tcb[task].budgetLeft > 0)
+        return false;
+    tcb[task].overruns++;
+    if (tcb[task].budgetAction == BUDGET_HOLD)
+    {
+        // a task that blocked just before the tick is not on the ready lists
+        if (tcb[task].readyNext != NO_TASK)
+        {
+            readyRemove(task);
+            tcb[task].state = STATE_THROTTLED;
+            rescheduleNeeded = true;
+            return true;
+        }
+    }
+    else if (!tcb[task].demoted)
+    {
+        // mutexPriority applies the demotion, inheritance can still lift it
+        tcb[task].demoted = true;
+        propagatePriority(task);
+        rescheduleNeeded = true;
+        return true;
+    }
+    return false;
+}
+
+// give a throttled or demoted task its priority back
+void budgetRestore(uint8_t task)
+{
+    if (tcb[task].state == STATE_THROTTLED)
+    {
+        tcb[task].state = STATE_READY;
+        readyInsert(task);
+    }
+    if (tcb[task].demoted)
+    {
+        tcb[task].demoted = false;
+        propagatePriority(task);
+        rescheduleNeeded = true;
+    }
+}
+
+// refill the budgets whose period ended and find the next replenishment,
+// periods stay on a fixed grid even when ticks were skipped by tickless idle
+// the tick only calls this once nextReplenish is reached
+void budgetReplenish()
+{
+    uint8_t i;
+    bool first = true;
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if (tcb[i].budget == 0)
+            continue;
+        if ((int32_t)(tickCount - tcb[i].replenishAt) >= 0)
+        {
+            while ((int32_t)(tickCount - tcb[i].replenishAt) >= 0)
+                tcb[i].replenishAt += tcb[i].budgetPeriod;
+            tcb[i].budgetLeft = tcb[i].budget;
+            budgetRestore(i);
+        }
+        if (first || (int32_t)(tcb[i].replenishAt - nextReplenish) < 0)
+            nextReplenish = tcb[i].replenishAt;
+        first = false;
+    }
+}
+
+// advance kernel time by ticks that passed with SysTick stretched
+// caller guarantees ticks is less than the first sleeper's remaining ticks
+// and the debounce time left
+void stepTicks(uint32_t ticks)
+{
+    tickCount += ticks;
+    suppressedTicks += ticks;
+    if (sleepHead != NO_TASK)
+        tcb[sleepHead].ticks -= ticks;
+    if (debounceTicks != 0)
+        debounceTicks -= ticks;
+}
+
+// tickless idle: called from the idle task, when it is the only runnable task
+// SysTick is reprogrammed to fire at the first sleeper's deadline and the
+// core sleeps in WFI, then the tick count is corrected for the time asleep
+void suppressTicks()
+{
+    uint32_t idleTicks, partial, reload, elapsed, completed;
+    __asm("     CPSID I");
+    idleTicks = MAX_IDLE_TICKS;
+    if (sleepHead != NO_TASK && tcb[sleepHead].ticks < idleTicks)
+        idleTicks = tcb[sleepHead].ticks;
+    if (debounceTicks != 0 && debounceTicks < idleTicks)
+        idleTicks = debounceTicks;
+    // a held task has to be back in time for its replenishment
+    if (budgetTasks != 0 && nextReplenish - tickCount < idleTicks)
+        idleTicks = nextReplenish - tickCount;
+    // give up if another task is ready, a tick is pending or the wait is too short
+    if (readyBitmap != PRIORITY_BIT(tcb[taskCurrent].priority)
+            || tcb[taskCurrent].readyNext != taskCurrent
+            || (NVIC_INT_CTRL_R & NVIC_INT_CTRL_PENDSTSET)
+            || idleTicks < 2)
+    {
+        __asm("     CPSIE I");
+        return;
+    }
+    // stretch the current period by the whole ticks that can be skipped
+    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC | NVIC_ST_CTRL_INTEN;
+    partial = NVIC_ST_CURRENT_R;   // cycles left in the current tick
+    reload = partial + (idleTicks - 1) * TICK_CYCLES;
+    NVIC_ST_RELOAD_R = reload;
+    NVIC_ST_CURRENT_R = 0;
+    NVIC_ST_CTRL_R |= NVIC_ST_CTRL_ENABLE;
+    __asm("     WFI");
+    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC | NVIC_ST_CTRL_INTEN;
+    if (NVIC_ST_CTRL_R & NVIC_ST_CTRL_COUNT)
+    {
+        // slept to the deadline, the pending tick interrupt counts the last tick
+        // and the next period is shortened by what already elapsed after the wrap
+        elapsed = reload - NVIC_ST_CURRENT_R;
+        if (elapsed >= TICK_CYCLES - 1)
+            NVIC_ST_RELOAD_R = TICK_CYCLES - 1;
+        else
+            NVIC_ST_RELOAD_R = TICK_CYCLES - 1 - elapsed;
+        completed = idleTicks - 1;
+    }
+    else
+    {
+        // woken early by another interrupt, count the tick boundaries that
+        // passed and finish the partial tick before the normal period resumes
+        elapsed = reload - NVIC_ST_CURRENT_R;
+        if (elapsed < partial)
+        {
+            completed = 0;
+            NVIC_ST_RELOAD_R = partial - elapsed;
+        }
+        else
+        {
+            completed = 1 + (elapsed - partial) / TICK_CYCLES;
+            NVIC_ST_RELOAD_R = TICK_CYCLES - (elapsed - partial) % TICK_CYCLES;
+        }
+    }
+    NVIC_ST_CURRENT_R = 0;
+    NVIC_ST_CTRL_R |= NVIC_ST_CTRL_ENABLE;
+    stepTicks(completed);
+    NVIC_ST_RELOAD_R = TICK_CYCLES - 1;
+    __asm("     CPSIE I");
+}
+
+// record a log entry from a task or ISR: a reservation and a few stores, no
+// locking and no formatting, the record is dropped if the ring is full
+void logWrite(uint8_t id, uint8_t n, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    uint32_t start = atomicReserve(&logHead, n + 2, logTail, LOG_SIZE);
+    if (start == 0xFFFFFFFF)
+    {
+        logDropped++;
+        return;
+    }
+    logRing[(start + 1) & (LOG_SIZE - 1)] = tickCount;
+    if (n > 0) logRing[(start + 2) & (LOG_SIZE - 1)] = a;
+    if (n > 1) logRing[(start + 3) & (LOG_SIZE - 1)] = b;
+    if (n > 2) logRing[(start + 4) & (LOG_SIZE - 1)] = c;
+    if (n > 3) logRing[(start + 5) & (LOG_SIZE - 1)] = d;
+    logRing[start & (LOG_SIZE - 1)] = 0x80000000 | (taskCurrent << 16) | (id << 8) | n;
+}
+
+#ifdef TRACE
+void traceEvent(uint8_t type, uint8_t task, uint8_t arg)
+{
+    traceEntry *e = &traceRing[traceNext];
+    if (!traceOn)
+        return;
+    e->time = DWT_CYCCNT_R;
+    e->type = type;
+    e->task = task;
+    e->arg = arg;
+    traceNext = (traceNext + 1) & (TRACE_SIZE - 1);
+    if (traceCount < TRACE_SIZE)
+        traceCount++;
+}
+#endif
+
+// true if the block of size bytes at base has no owner, base is aligned to
+// size by the callers
+bool stackBlockFree(uint32_t base, uint32_t size)
+{
+    uint8_t first = (base - HEAP_BASE) / PAGE_SIZE;
+    uint8_t i;
+    for (i = 0; i < size / PAGE_SIZE; i++)
+    {
+        if (pageOwner[first + i] != NO_TASK)
+            return false;
+    }
+    return true;
+}
+
+// find a free block for a stack of at least bytes above its guard, first fit
+// among the blocks of that power-of-two size aligned to their size
+// returns the base of the block or 0 if the pool has no room
+void *stackAlloc(uint8_t task, uint32_t bytes)
+{
+    uint32_t size = PAGE_SIZE;
+    uint32_t base;
+    uint8_t first, i;
+    while (size - GUARD_BYTES(size) < bytes)
+    {
+        size <<= 1;
+    }
+    for (base = (HEAP_BASE + size - 1) & ~(size - 1); base + size <= HEAP_END; base += size)
+    {
+        if (stackBlockFree(base, size))
+        {
+            first = (base - HEAP_BASE) / PAGE_SIZE;
+            for (i = 0; i < size / PAGE_SIZE; i++)
+            {
+                pageOwner[first + i] = task;
+            }
+            tcb[task].stack = (void *)base;
+            tcb[task].stackSize = size;
+            return (void *)base;
+        }
+    }
+    return 0;
+}
+
+// return the stack block of a task to the pool, the size is kept so the
+// task can get an equal block back when it is restarted
+void stackFree(uint8_t task)
+{
+    uint8_t first, i;
+    if (tcb[task].stack == 0)
+        return;
+    first = ((uint32_t)tcb[task].stack - HEAP_BASE) / PAGE_SIZE;
+    for (i = 0; i < tcb[task].stackSize / PAGE_SIZE; i++)
+    {
+        pageOwner[first + i] = NO_TASK;
+    }
+    tcb[task].stack = 0;
+}
+
+// size of the largest block stackAlloc could hand out right now, tried from
+// the largest power of two that fits the pool down to one page
+uint32_t stackLargestFree()
+{
+    uint32_t size = PAGE_SIZE;
+    uint32_t base;
+    while (size << 1 <= HEAP_END - HEAP_BASE)
+    {
+        size <<= 1;
+    }
+    for (; size >= PAGE_SIZE; size >>= 1)
+    {
+        for (base = (HEAP_BASE + size - 1) & ~(size - 1); base + size <= HEAP_END; base += size)
+        {
+            if (stackBlockFree(base, size))
+                return size;
+        }
+    }
+    return 0;
+}
+
+// precompute the guard region of a task so a switch is just two stores
+void mpuStackRegion(uint8_t task)
+{
+    uint32_t size = tcb[task].stackSize;
+    uint8_t log2 = 0;
+    while ((1u << log2) < size)
+    {
+        log2++;
+    }
+    tcb[task].mpuBase = (uint32_t)tcb[task].stack | NVIC_MPU_BASE_VALID | STACK_REGION;
+    // SIZE field is log2(bytes) - 1, AP 0 is no access for everyone
+    tcb[task].mpuAttr = NVIC_MPU_ATTR_XN | GUARD_SRD | ((log2 - 1) << 1) | NVIC_MPU_ATTR_ENABLE;
+}
+
+// fill the usable part of a stack (above the guard) with the paint pattern
+void stackPaint(uint8_t task)
+{
+    uint32_t *p = (uint32_t *)((uint8_t *)tcb[task].stack + GUARD_BYTES(tcb[task].stackSize));
+    while (p < (uint32_t *)tcb[task].spInit)
+    {
+        *p++ = STACK_PAINT;
+    }
+    tcb[task].stackPeak = 0;
+}
+
+// high-water mark of a task from the lowest word that lost its paint
+void stackCheck(uint8_t task)
+{
+    uint32_t *p, *top;
+    uint32_t used;
+    if (tcb[task].state == STATE_INVALID || tcb[task].stack == 0)
+        return;
+    p = (uint32_t *)((uint8_t *)tcb[task].stack + GUARD_BYTES(tcb[task].stackSize));
+    top = (uint32_t *)tcb[task].spInit;
+    while (p < top && *p == STACK_PAINT)
+    {
+        p++;
+    }
+    used = (uint8_t *)top - (uint8_t *)p;
+    if (used > tcb[task].stackPeak)
+        tcb[task].stackPeak = used;
+}
+
+#ifndef HOST_PORT
+// build the frame pendSVIsr restores for a task that has never run:
+// R4-R11 and EXC_RETURN below the hardware frame R0-R3, R12, LR, PC, xPSR
+// EXC_RETURN selects thread mode on PSP without FP state, a task only gets
+// an extended frame once it executes its first FP instruction
+void initTaskFrame(uint8_t task)
+{
+    uint8_t i;
+    uint32_t *sp = tcb[task].spInit;
+    *(--sp) = 0x01000000;                      // xPSR, thumb state
+    *(--sp) = (uint32_t)tcb[task].pFn & ~1;    // PC
+    *(--sp) = 0xFFFFFFFD;                      // LR, tasks never return
+    for (i = 0; i < 5; i++)
+    {
+        *(--sp) = 0;                           // R12, R3-R0
+    }
+    *(--sp) = 0xFFFFFFFD;                      // EXC_RETURN
+    for (i = 0; i < 8; i++)
+    {
+        *(--sp) = 0;                           // R11-R4
+    }
+    tcb[task].sp = sp;
+}
+#endif
 
 // REQUIRED: Implement prioritization to 8 levels
+// PR mode finds the highest ready level with one CLZ and takes the head of
+// that level's list, the head only moves on when its slice runs out or it
+// yields or blocks, so equal priorities round-robin by quantum
 int rtosScheduler()
 {
     bool ok;
     static uint8_t task = 0xFF;
+    uint8_t i, best;
     ok = false;
+    if(scheduler == EDF)
+    {
+        // ready periodic task with the earliest deadline, compared wrap safe
+        best = NO_TASK;
+        for (i = 0; i < MAX_TASKS; i++)
+        {
+            if (tcb[i].period != 0 && tcb[i].readyNext != NO_TASK
+                    && (best == NO_TASK || (int32_t)(tcb[i].absDeadline - tcb[best].absDeadline) < 0))
+                best = i;
+        }
+        if (best != NO_TASK)
+        {
+            task = best;
+            return task;
+        }
+    }
     if(scheduler == RR)
     {
         while (!ok)
@@ -229,169 +1331,462 @@ int rtosScheduler()
     }
     else
     {
-        uint8_t level = 0;
-        uint8_t temp = taskCurrent;//+1)%MAX_TASKS;
-        while(level<MAX_PRIORITIES)
+        task = readyHead[CLZ(readyBitmap)];
+    }
+    return task;
+}
+
+bool createThread(fn task, const char name[], uint8_t priority, uint32_t stackBytes)
+{
+    bool ok = false;
+    uint8_t i = 0, j = 0;
+    bool found = false;
+    // REQUIRED:
+    // store the thread name
+    // allocate stack space and store top of stack in sp and spInit
+    // add task if room in task list
+    if (taskCount < MAX_TASKS)
+    {
+        // make sure task not already in list (prevent reentrancy)
+        while (!found && (i < MAX_TASKS))
+        {
+            found = (tcb[i++].pFn == task);
+        }
+        if (!found)
+        {
+            // find first available tcb record
+            i = 0;
+            while (tcb[i].state != STATE_INVALID) {i++;}
+            if (stackAlloc(i, stackBytes) == 0)
+            {
+                LOG1(LOG_NO_STACK, stackBytes);
+                return false;
+            }
+            tcb[i].state = STATE_UNRUN;
+            tcb[i].pid = pidCounter++;
+            tcb[i].pFn = task;
+            tcb[i].spInit = (uint8_t *)tcb[i].stack + tcb[i].stackSize;
+            mpuStackRegion(i);
+            stackPaint(i);
+            initTaskFrame(i);
+#ifdef DEBUG
+            LOG4(LOG_CREATE, i, tcb[i].pid, (uint32_t)tcb[i].stack, (uint32_t)tcb[i].spInit);
+#endif
+            // name copy
+            for(j=0; name[j]!='\0'; j++)
+            {
+                tcb[i].name[j] = name[j];
+            }
+            tcb[i].priority = priority;
+            tcb[i].basePriority = priority;
+            tcb[i].userPriority = priority;
+            tcb[i].quantum = 0;
+            tcb[i].timedWake = false;
+            tcb[i].releases = 0;
+            tcb[i].jitterWorstUs = 0;
+            tcb[i].jitterTotalUs = 0;
+            tcb[i].budget = 0;
+            tcb[i].demoted = false;
+            tcb[i].period = 0;
+            tcb[i].jobDone = true;
+            tcb[i].fpu = false;
+            tcb[i].queue = 0;
+            tcb[i].mutexWait = NO_MUTEX;
+            readyInsert(i);
+            // increment task count
+            taskCount++;
+            ok = true;
+        }
+    }
+    return ok;
+}
+
+// create a thread that uses floating point, its stack is grown to hold the
+// FP context the lazy stacking and pendSVIsr save when it is switched out
+// integer-only threads can use createThread and pay nothing for the FPU, the
+// FPU is turned off while they run so using it is a usage fault
+bool createFpuThread(fn task, const char name[], uint8_t priority, uint32_t stackBytes)
+{
+    uint8_t i;
+    bool ok = createThread(task, name, priority, stackBytes + FPU_CONTEXT_BYTES);
+    if (ok)
+    {
+        for (i = 0; i < MAX_TASKS; i++)
+        {
+            if (tcb[i].pFn == task)
+                tcb[i].fpu = true;
+        }
+    }
+    return ok;
+}
+
+// REQUIRED: modify this function to restart a thread
+// returns false if a destroyed thread cannot get its stack back
+bool restartThread(fn task)
+{
+    int i;
+    for(i = 0; i<MAX_TASKS; i++)
+    {
+        if (tcb[i].pFn == task)
+        {
+            __asm("     CPSID I");
+            // a destroyed thread gets a stack from the pool again
+            if (tcb[i].stack == 0 && stackAlloc(i, tcb[i].stackSize - GUARD_BYTES(tcb[i].stackSize)) == 0)
+            {
+                __asm("     CPSIE I");
+                LOG1(LOG_NO_STACK, tcb[i].stackSize);
+                return false;
+            }
+            tcb[i].spInit = (uint8_t *)tcb[i].stack + tcb[i].stackSize;
+            mpuStackRegion(i);
+            if (tcb[i].state == STATE_DELAYED)
+                sleepRemove(i);
+            tcb[i].pid = pidCounter++;
+            stackPaint(i);
+            initTaskFrame(i);
+            LOG2(LOG_RESTART, i, tcb[i].pid);
+            tcb[i].ticks=0;
+            tcb[i].timedWake = false;
+            // a restarted task starts a fresh budget at its own priority
+            tcb[i].budgetLeft = tcb[i].budget;
+            if (tcb[i].demoted)
+            {
+                tcb[i].demoted = false;
+                tcb[i].priority = mutexPriority(i);
+            }
+            tcb[i].state = STATE_UNRUN;
+            tcb[i].jobDone = true;
+            readyInsert(i);
+            __asm("     CPSIE I");
+            return true;
+        }
+    }
+    return false;
+}
+
+// REQUIRED: modify this function to destroy a thread
+// REQUIRED: remove any pending semaphore waiting
+// NOTE: see notes in class for strategies on whether stack is freed or not
+void destroyThread(fn task)
+{
+    uint8_t tempPID = NO_TASK, i, j;
+    for(i = 0; i<MAX_TASKS; i++)
+    {
+        if (tcb[i].pFn == task)
+        {
+            tempPID = i;
+            break;
+        }
+    }
+    if(tempPID == NO_TASK)
+        return;
+    __asm("     CPSID I");
+    if(tcb[tempPID].state == STATE_DELAYED)
+    {
+        sleepRemove(tempPID);
+    }
+    // leave a mutex wait and give back priority the owner inherited from us
+    if(tcb[tempPID].mutexWait != NO_MUTEX)
+    {
+        i = tcb[tempPID].mutexWait;
+        queueRemove(&mutexes[i].queue, tempPID);
+        tcb[tempPID].mutexWait = NO_MUTEX;
+        propagatePriority(mutexes[i].owner);
+    }
+    // any other wait queue is unlinked directly through the tcb
+    if(tcb[tempPID].queue != 0)
+    {
+        queueRemove(tcb[tempPID].queue, tempPID);
+    }
+    // a semaphore the task acquired is handed to the next waiter
+    i = tcb[tempPID].s;
+    if(i != 0 && (tcb[tempPID].state == STATE_READY || tcb[tempPID].state == STATE_DELAYED
+            || tcb[tempPID].state == STATE_THROTTLED))
+    {
+        j = queuePop(&semaphores[i].queue);
+        if(j != NO_TASK)
+        {
+            semaphoreWaited(j, i);
+            tcb[j].s = i;
+            tcb[j].state = STATE_READY;
+            readyInsert(j);
+        }
+    }
+    // mutexes held by a killed task pass on to their waiters
+    for(i = 0; i < MAX_MUTEXES; i++)
+    {
+        if(mutexes[i].owner == tempPID)
+        {
+            mutexRelease(i);
+        }
+    }
+    // buffers the task was holding, including one stuck in a blocked send,
+    // go back to the pool
+    for(i = 0; i < BUFFER_COUNT; i++)
+    {
+        if(bufferOwner[i] == tempPID)
+        {
+            bufferRelease(i);
+        }
+    }
+    readyRemove(tempPID);
+    tcb[tempPID].priority = tcb[tempPID].basePriority;
+    tcb[tempPID].state = STATE_HOLD;
+    // the stack goes back to the pool, a task killing itself still runs on it
+    // until the switch pended here, so taskSwitch frees it after leaving it
+    if(tempPID == taskCurrent)
+    {
+        stackReclaim = tempPID;
+        rescheduleNeeded = true;
+        NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+    }
+    else
+    {
+        stackFree(tempPID);
+    }
+    LOG1(LOG_DESTROY, tempPID);
+    __asm("     CPSIE I");
+}
+
+// REQUIRED: modify this function to set a thread priority
+void rmAssign();
+
+void setThreadPriority(fn task, uint8_t priority)
+{
+    uint8_t i;
+    for(i = 0; i<MAX_TASKS; i++)
+    {
+        if(tcb[i].pFn == task)
         {
-            temp = (temp+1) % MAX_TASKS;
-            if((tcb[temp].state == (STATE_READY) || tcb[temp].state == (STATE_UNRUN)) && tcb[temp].priority == level)
+            __asm("     CPSID I");
+            tcb[i].userPriority = priority;
+            if (scheduler == RM && tcb[i].period != 0)
             {
-                return temp;
+                // rate monotonic keeps ranking periodic tasks itself
+                __asm("     CPSIE I");
+                continue;
             }
-            if(temp == taskCurrent)
-                level++;
+            // inherited priority still applies on top of the new base
+            tcb[i].basePriority = priority;
+            propagatePriority(i);
+            __asm("     CPSIE I");
         }
     }
-    return task;
+    if (scheduler == RM)
+        rmAssign();
 }
 
-bool createThread(fn task, const char name[], uint8_t priority, uint32_t stackBytes)
+// declare a task periodic: released every period ticks, due deadline ticks
+// after release and needing at most wcet ticks per job
+// a job ends when the task blocks or sleeps, the next wake releases another
+bool setThreadPeriod(fn task, uint32_t period, uint32_t deadline, uint32_t wcet)
 {
+    uint8_t i;
     bool ok = false;
-    uint8_t i = 0, j = 0;
-    bool found = false;
-    // REQUIRED:
-    // store the thread name
-    // allocate stack space and store top of stack in sp and spInit
-    // add task if room in task list
-    if (taskCount < MAX_TASKS)
+    for(i = 0; i<MAX_TASKS; i++)
     {
-        // make sure task not already in list (prevent reentrancy)
-        while (!found && (i < MAX_TASKS))
-        {
-            found = (tcb[i++].pFn == task);
-        }
-        if (!found)
+        if(tcb[i].pFn == task && period != 0)
         {
-            // find first available tcb record
-            i = 0;
-            while (tcb[i].state != STATE_INVALID) {i++;}
-            tcb[i].state = STATE_UNRUN;
-            tcb[i].pid = pidCounter++;
-            tcb[i].pFn = task;
-            tcb[i].sp = &heap[allocated_heap+(stackBytes>>2)];
-            allocated_heap += stackBytes>>2;
-            tcb[i].spInit = tcb[i].sp;
-#ifdef DEBUG
-            sprintf(str, "stackbase = %p\t, %p\r\n", tcb[i].sp, tcb[i].spInit);
-            putsUart0(str);
-#endif
-            // name copy
-            for(j=0; name[j]!='\0'; j++)
-            {
-                tcb[i].name[j] = name[j];
-            }
-            tcb[i].priority = priority;
-            // increment task count
-            taskCount++;
+            __asm("     CPSID I");
+            tcb[i].period = period;
+            tcb[i].deadline = deadline ? deadline : period;
+            tcb[i].wcet = wcet;
+            tcb[i].absDeadline = tickCount + tcb[i].deadline;
+            tcb[i].deadlineMisses = 0;
+            __asm("     CPSIE I");
             ok = true;
         }
     }
+    if (ok && scheduler == RM)
+        rmAssign();
     return ok;
 }
 
-// REQUIRED: modify this function to restart a thread
-void restartThread(fn task)
+// limit a task to budget ticks of CPU every period ticks, BUDGET_DEMOTE runs
+// it at background priority for the rest of the period, BUDGET_HOLD stops it
+// a budget of 0 removes the limit
+void setThreadBudget(fn task, uint32_t budget, uint32_t period, uint8_t action)
 {
-    int i;
+    uint8_t i;
     for(i = 0; i<MAX_TASKS; i++)
     {
-        if (tcb[i].pFn == task)
+        if(tcb[i].pFn == task)
         {
-            tcb[i].pid = pidCounter++;
-            tcb[i].sp =tcb[i].spInit;
-            tcb[i].ticks=0;
-            tcb[i].state = STATE_UNRUN;
-            break;
+            __asm("     CPSID I");
+            budgetRestore(i);
+            if (tcb[i].budget != 0)
+                budgetTasks--;
+            tcb[i].budget = (period != 0) ? budget : 0;
+            if (tcb[i].budget != 0)
+                budgetTasks++;
+            tcb[i].budgetPeriod = period;
+            tcb[i].budgetLeft = budget;
+            tcb[i].replenishAt = tickCount + period;
+            tcb[i].budgetAction = action;
+            budgetReplenish();
+            __asm("     CPSIE I");
         }
     }
 }
 
-// REQUIRED: modify this function to destroy a thread
-// REQUIRED: remove any pending semaphore waiting
-// NOTE: see notes in class for strategies on whether stack is freed or not
-void destroyThread(fn task)
+// slice length of a task in ticks, 0 goes back to its priority level's quantum
+void setThreadQuantum(fn task, uint8_t ticks)
 {
-    uint8_t tempPID, i, j;
+    uint8_t i;
     for(i = 0; i<MAX_TASKS; i++)
     {
-        if (tcb[i].pFn == task)
+        if(tcb[i].pFn == task)
         {
-            tempPID = i;
-            break;
+            tcb[i].quantum = ticks;
         }
     }
-    if(tcb[tempPID].state == STATE_BLOCKED)
+}
+
+bool createPeriodicThread(fn task, const char name[], uint8_t priority, uint32_t stackBytes,
+                          uint32_t period, uint32_t deadline, uint32_t wcet)
+{
+    return createThread(task, name, priority, stackBytes) && setThreadPeriod(task, period, deadline, wcet);
+}
+
+// rate monotonic: periodic tasks take the top levels by period, shortest
+// first and equal periods sharing a level, aperiodic tasks keep their own
+// priority but stay below every periodic level
+// leaving RM puts every task back on its own priority
+void rmAssign()
+{
+    uint8_t i, j, level, levels = 0;
+    __asm("     CPSID I");
+    for (i = 0; i < MAX_TASKS; i++)
     {
-        for(i = 1; i < 5; i++)
+        if (tcb[i].state == STATE_INVALID || tcb[i].period == 0 || scheduler != RM)
+            continue;
+        // rank = number of distinct shorter periods
+        level = 0;
+        for (j = 0; j < MAX_TASKS; j++)
         {
-            for(j=0; j<2; j++)
+            if (tcb[j].state != STATE_INVALID && tcb[j].period != 0 && tcb[j].period < tcb[i].period)
             {
-                if(semaphores[i].processQueue[j] == tempPID)
-                {
-                    if(j == 0)
-                    {
-                        semaphores[i].processQueue[0] = semaphores[i].processQueue[1];
-                        semaphores[i].processQueue[1] = 0;
-                        semaphores[i].queueSize--;
-                    }
-                    else
-                    {
-                        semaphores[i].processQueue[1] = 0;
-                        semaphores[i].queueSize--;
-                    }
-                }
+                bool seen = false;
+                uint8_t k;
+                for (k = 0; k < j; k++)
+                    seen |= (tcb[k].state != STATE_INVALID && tcb[k].period == tcb[j].period);
+                if (!seen)
+                    level++;
             }
         }
+        if (level > MAX_PRIORITIES - 2)
+            level = MAX_PRIORITIES - 2;
+        if (level + 1 > levels)
+            levels = level + 1;
+        tcb[i].basePriority = level;
+        propagatePriority(i);
     }
-    for(i = 1; i <5; i++)
+    for (i = 0; i < MAX_TASKS; i++)
     {
-        if(tcb[tempPID].s == i && (tcb[tempPID].state == STATE_READY || tcb[tempPID].state == STATE_DELAYED))
-        {
-            // tcb[i].s = 0;
-            if(semaphores[i].queueSize > 0)
-            {
-                tcb[semaphores[i].processQueue[0]].state = STATE_READY;
-                //tcb[semaphores[i].processQueue[0]].s = 0;
-                semaphores[i].processQueue[0] = semaphores[i].processQueue[1];
-                //semaphores[i].processQueue[1] = 0;
-                semaphores[i].queueSize--;
-            }
-        }
+        if (tcb[i].state == STATE_INVALID || (tcb[i].period != 0 && scheduler == RM))
+            continue;
+        level = tcb[i].userPriority;
+        if (scheduler == RM && level < levels)
+            level = levels;
+        tcb[i].basePriority = level;
+        propagatePriority(i);
     }
-    tcb[tempPID].state = STATE_HOLD;
+    __asm("     CPSIE I");
 }
 
-// REQUIRED: modify this function to set a thread priority
-void setThreadPriority(fn task, uint8_t priority)
+// processor utilization of the periodic tasks in tenths of a percent
+uint32_t periodicUtilization(uint8_t *count)
 {
     uint8_t i;
-    for(i = 0; i<MAX_TASKS; i++)
+    uint32_t u = 0;
+    *count = 0;
+    for (i = 0; i < MAX_TASKS; i++)
     {
-        if(tcb[i].pFn == task)
+        if (tcb[i].state != STATE_INVALID && tcb[i].period != 0)
         {
-            tcb[i].priority = priority;
+            u += tcb[i].wcet * 1000 / tcb[i].period;
+            (*count)++;
         }
     }
+    return u;
 }
 
-bool createSemaphore(uint8_t semaphore, uint8_t count)
+// order is QUEUE_FIFO or QUEUE_PRIORITY, the order blocked tasks are woken in
+bool createSemaphore(uint8_t semaphore, uint8_t count, uint8_t order)
 {
     bool ok = (semaphore < MAX_SEMAPHORES);
+    if (ok)
     {
         semaphores[semaphore].count = count;
+        semaphores[semaphore].queue.order = order;
+    }
+    return ok;
+}
+
+// order is QUEUE_FIFO or QUEUE_PRIORITY for both blocked senders and receivers
+bool createMailbox(uint8_t box, uint8_t order)
+{
+    bool ok = (box < MAX_MAILBOXES);
+    if (ok)
+    {
+        mailboxes[box].head = 0;
+        mailboxes[box].count = 0;
+        mailboxes[box].senders.order = order;
+        mailboxes[box].receivers.order = order;
+    }
+    return ok;
+}
+
+// flags set from an ISR running at the kernel interrupt priority
+void setFlagsFromIsr(uint8_t group, uint32_t mask)
+{
+    flagsSet(group, mask);
+    if (rescheduleNeeded && preemption)
+        NVIC_INT_CTRL_R |= NVIC_INT_CTRL_PEND_SV;
+}
+
+// clearing never wakes anyone, so no service call is needed
+void clearFlags(uint8_t group, uint32_t mask)
+{
+    __asm("     CPSID I");
+    flagGroups[group].flags &= ~mask;
+    __asm("     CPSIE I");
+}
+
+// protocol is MUTEX_INHERIT or MUTEX_CEILING, ceiling is only used by the latter
+bool createMutex(uint8_t m, uint8_t protocol, uint8_t ceiling)
+{
+    bool ok = (m < MAX_MUTEXES);
+    if (ok)
+    {
+        mutexes[m].owner = NO_TASK;
+        mutexes[m].protocol = protocol;
+        mutexes[m].ceiling = ceiling;
+        mutexes[m].errors = 0;
     }
     return ok;
 }
 
+// block until a whole line is in the rx ring, then edit it into data
+// a line is ended by enter or by the ring filling up, the whole line is
+// taken off the ring and what does not fit in data is dropped
 void getsUart0(USER_DATA *data)
 {
     int count = 0;
+    uint32_t flags;
     char ch;
 
-    while (count <= (MAX_CHARS))
+    while (rxLines == 0)
     {
-        ch = getcUart0();
+        waitFlags(uartFlags, UART_LINE, FLAGS_ANY | FLAGS_CLEAR, &flags);
+    }
+    __asm("     CPSID I");
+    rxLines--;
+    __asm("     CPSIE I");
+    while (rxTail != rxHead)
+    {
+        ch = uartRx[rxTail];
+        rxTail = (rxTail + 1) & (UART_RX_SIZE - 1);
         if (ch == 8 || ch == 127)
         {
             if (count > 0)
@@ -404,19 +1799,16 @@ void getsUart0(USER_DATA *data)
 
         if (ch == 13)
         {
-            data->buffer[count] = '\0';
             break;                       // exit when enter key is pressed
         }
 
-        data->buffer[count] = ch;       // Update buffer array
-        count++;
-
-        if (count == MAX_CHARS)
+        if (count < MAX_CHARS)
         {
-            data->buffer[count + 1] = '\0';
-            break;                        // exit when max chars reached
+            data->buffer[count] = ch;   // Update buffer array
+            count++;
         }
     }
+    data->buffer[count] = '\0';
 }
 
 void parseFields(USER_DATA *data)
@@ -550,34 +1942,143 @@ void itostring(int n, char* s)
     }
 }
 
-void uart0ISR()
+#ifndef HOST_PORT
+// hand the buffer being filled to uDMA if it is idle and there is data,
+// writers move on to the other buffer, called with interrupts off
+void uartTxKick()
 {
+    uint16_t n = txCount[txFill];
+    uint32_t *ch = &dmaTable[UART_TX_DMA_CH * 4];
+    if (txBusy || n == 0)
+        return;
+    ch[0] = (uint32_t)&uartTx[txFill][n - 1];    // source end pointer
+    ch[1] = (uint32_t)&UART0_DR_R;               // destination end pointer
+    ch[2] = UDMA_CHCTL_DSTINC_NONE | UDMA_CHCTL_DSTSIZE_8 | UDMA_CHCTL_SRCINC_8
+          | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4
+          | ((n - 1) << UDMA_CHCTL_XFERSIZE_S) | UDMA_CHCTL_XFERMODE_BASIC;
+    UDMA_ENASET_R = 1 << UART_TX_DMA_CH;
+    txBusy = true;
+    txFill ^= 1;
+    txCount[txFill] = 0;
+}
+#endif
 
-    if(UART0_FR_R & UART_FR_TXFE)
+// rx: store until the ring is full, a line end wakes the shell
+// tx: uDMA completion arrives on the UART vector, the next buffer is started
+// and writers waiting for room are woken
+void uart0ISR()
+{
+    uint16_t next;
+    char ch;
+    bool line = false;
+    UART0_ICR_R = UART_ICR_RXIC | UART_ICR_RTIC;
+    while (!(UART0_FR_R & UART_FR_RXFE))
     {
-        if(txIndex != rxIndex)
+        ch = UART0_DR_R & 0xFF;
+        next = (rxHead + 1) & (UART_RX_SIZE - 1);
+        if (next == rxTail)
+            continue;                   // ring full, the line was already ended
+        uartRx[rxHead] = ch;
+        rxHead = next;
+        if (ch == 13 || ((next + 1) & (UART_RX_SIZE - 1)) == rxTail)
         {
-            UART0_DR_R = UImessage[rxIndex];
-            rxIndex = (rxIndex + 1) % UI_BUFFER_LENGTH;
+            rxLines++;
+            line = true;
         }
+    }
+    if (line)
+        setFlagsFromIsr(uartFlags, UART_LINE);
+    if (UDMA_CHIS_R & (1 << UART_TX_DMA_CH))
+    {
+        UDMA_CHIS_R = 1 << UART_TX_DMA_CH;
+        txBusy = false;
+        uartTxKick();
+        setFlagsFromIsr(uartFlags, UART_TX_SPACE);
+    }
+}
 
-        else
+// receive and receive-timeout interrupts are always on, transmit is done by
+// uDMA channel 9 (UART0 TX) in basic mode from the ping-pong buffers
+void initUartRings()
+{
+    SYSCTL_RCGCDMA_R |= SYSCTL_RCGCDMA_R0;
+    _delay_cycles(3);
+    UDMA_CFG_R = UDMA_CFG_MASTEN;
+    UDMA_CTLBASE_R = (uint32_t)dmaTable;
+    UDMA_CHMAP1_R &= ~UDMA_CHMAP1_CH9SEL_M;      // encoding 0, UART0 TX
+    UDMA_PRIOCLR_R = 1 << UART_TX_DMA_CH;
+    UDMA_ALTCLR_R = 1 << UART_TX_DMA_CH;
+    UDMA_USEBURSTCLR_R = 1 << UART_TX_DMA_CH;
+    UDMA_REQMASKCLR_R = 1 << UART_TX_DMA_CH;
+    UART0_DMACTL_R |= UART_DMACTL_TXDMAE;
+    UART0_IM_R = UART_IM_RXIM | UART_IM_RTIM;
+    NVIC_EN0_R |= 1 << (INT_UART0-16);
+}
+
+// copy n bytes into the tx buffer and start uDMA if it is idle, a task
+// blocks only when both buffers are full (before the scheduler starts the
+// caller waits for the ISR instead)
+void uartWrite(const char *s, uint16_t n)
+{
+    uint32_t flags;
+    __asm("     CPSID I");
+    while (n > 0)
+    {
+        if (txCount[txFill] == UART_TX_SIZE)
         {
-            UART0_IM_R &= ~UART_IM_TXIM;
-            UART0_ICR_R |= UART_ICR_TXIC ;//| UART_ICR_RXIC;
+            uartTxKick();
+            if (txCount[txFill] == UART_TX_SIZE)
+            {
+                // interrupts back on around the wait, another writer may get in first
+                __asm("     CPSIE I");
+                if (rtosStarted)
+                    waitFlags(uartFlags, UART_TX_SPACE, FLAGS_ANY | FLAGS_CLEAR, &flags);
+                __asm("     CPSID I");
+                continue;
+            }
         }
+        uartTx[txFill][txCount[txFill]++] = *s++;
+        n--;
     }
+    uartTxKick();
+    __asm("     CPSIE I");
+}
+
+void uartPuts(const char *s)
+{
+    uartWrite(s, strlen(s));
+}
+
+void uartPutc(char c)
+{
+    char s[2];
+    s[0] = c;
+    s[1] = '\0';
+    uartPuts(s);
+}
+
+// CPU share of a task in the last window as "ddd.dd" in buffer,
+// the scale is taken once so each task costs a single 32-bit divide
+char *cpuPercent(uint8_t task, char *buffer)
+{
+    uint32_t scale = windowTotal / 10000;
+    uint32_t share = scale ? tcb[task].windowCycles / scale : 0;
+    if (share > 10000)
+        share = 10000;
+    sprintf(buffer, "%3u.%02u", share / 100, share % 100);
+    return buffer;
 }
 
 void guiAlignment(void)
 {
-    putcUart0('\r');
-    putcUart0('\n');
-    putcUart0('>');
+    uartPutc('\r');
+    uartPutc('\n');
+    uartPutc('>');
 }
 
 void processShell()
 {
+    char str[80];
     USER_DATA data;
     getsUart0(&data);
     parseFields(&data);
@@ -586,12 +2087,12 @@ void processShell()
     uint8_t i;
     for (i = 0; i < data.fieldCount; i++)
     {
-        putcUart0(data.fieldType[i]);
-        putcUart0('\t');
+        uartPutc(data.fieldType[i]);
+        uartPutc('\t');
         guiAlignment();
 
-        putsUart0(&data.buffer[data.fieldPosition[i]]);
-        putcUart0('\n');
+        uartPuts(&data.buffer[data.fieldPosition[i]]);
+        uartPutc('\n');
         guiAlignment();
     }
     if (isCommand(&data, "reboot", 0))
@@ -614,7 +2115,7 @@ void processShell()
             }
             else
             {
-                putsUart0("Invalid Argument\n");
+                uartPuts("Invalid Argument\n");
                 guiAlignment();
             }
 
@@ -634,16 +2135,129 @@ void processShell()
             {
                 scheduler = PR;
             }
+            else if (strCompare(firstArgument, "EDF"))
+            {
+                scheduler = EDF;
+            }
+            else if (strCompare(firstArgument, "RM"))
+            {
+                scheduler = RM;
+            }
             else
             {
-                putsUart0("Invalid Argument\n");
+                uartPuts("Invalid Argument\n");
                 guiAlignment();
             }
+            rmAssign();
+            // schedulability of the declared periodic set, EDF up to 100%,
+            // RM up to the Liu and Layland bound n(2^(1/n) - 1)
+            if (scheduler == EDF || scheduler == RM)
+            {
+                static const uint16_t rmBound[MAX_TASKS + 1] = {1000, 1000, 828, 779, 756, 743,
+                                                                734, 728, 724, 720, 717, 715, 713};
+                uint8_t n;
+                uint32_t u = periodicUtilization(&n);
+                uint32_t bound = (scheduler == EDF) ? 1000 : rmBound[n];
+                sprintf(str, "%u periodic tasks, utilization %u.%u%%, bound %u.%u%%\r\n",
+                        n, u / 10, u % 10, bound / 10, bound % 10);
+                uartPuts(str);
+                if (u > bound)
+                    uartPuts("deadlines may be missed\r\n");
+            }
 
 
         }
         valid = true;
     }
+    if (isCommand(&data, "tickless", 0))
+    {
+        if (data.fieldCount > 1)
+        {
+            char *firstArgument = getFieldString(&data, 1);
+            if (strCompare(firstArgument, "on"))
+            {
+                tickless = true;
+            }
+            else if (strCompare(firstArgument, "off"))
+            {
+                tickless = false;
+            }
+            else
+            {
+                uartPuts("Invalid Argument\n");
+                guiAlignment();
+            }
+        }
+        uartPuts(tickless ? "tickless on\r\n" : "tickless off\r\n");
+        sprintf(str, "ticks      %u\r\n", tickCount);
+        uartPuts(str);
+        sprintf(str, "suppressed %u\r\n", suppressedTicks);
+        uartPuts(str);
+        guiAlignment();
+        valid = true;
+    }
+#ifdef BENCHMARK
+    if (isCommand(&data, "bench", 0))
+    {
+        char line[80];
+        if (data.fieldCount > 1)
+        {
+            benchIterations = getFieldInteger(&data, 1);
+            if (benchIterations == 0)
+                benchIterations = 1;
+            if (benchIterations > BENCH_MAX_SAMPLES)
+                benchIterations = BENCH_MAX_SAMPLES;
+        }
+        post(benchStart);
+        wait(benchDone);
+        sprintf(line, "%u iterations, cycles at 40 MHz\r\n", benchIterations);
+        uartPuts(line);
+        uartPuts("path                     min       avg       p99       max\r\n");
+        for (i = 0; i < BENCH_TESTS; i++)
+        {
+            sprintf(line, "%-18s %9u %9u %9u %9u\r\n", benchNames[i], benchResults[i].min,
+                    benchResults[i].avg, benchResults[i].p99, benchResults[i].max);
+            uartPuts(line);
+        }
+        if (!preemption)
+            uartPuts("preemption off: tick to task includes the running task's slice\r\n");
+        guiAlignment();
+        valid = true;
+    }
+#endif
+#ifdef TRACE
+    // dump the trace ring oldest first, tools/trace2chrome.py reads this
+    if (isCommand(&data, "trace", 0))
+    {
+        uint16_t k, n, e;
+        traceOn = false;
+        n = traceCount;
+        e = (traceNext - n) & (TRACE_SIZE - 1);
+        uartPuts("trace begin\r\n");
+        sprintf(str, "clock %u\r\n", 40000000);
+        uartPuts(str);
+        for (i = 0; i < MAX_TASKS; i++)
+        {
+            if (tcb[i].state != STATE_INVALID)
+            {
+                sprintf(str, "task %u %s\r\n", i, tcb[i].name);
+                uartPuts(str);
+            }
+        }
+        for (k = 0; k < n; k++)
+        {
+            sprintf(str, "%u %u %u %u\r\n", traceRing[e].time, traceRing[e].type,
+                    traceRing[e].task, traceRing[e].arg);
+            uartPuts(str);
+            e = (e + 1) & (TRACE_SIZE - 1);
+        }
+        uartPuts("trace end\r\n");
+        traceCount = 0;
+        traceOn = true;
+        guiAlignment();
+        valid = true;
+    }
+#endif
     if (isCommand(&data, "pidof", 1))
     {
         uint8_t taskToPrint;
@@ -657,12 +2271,12 @@ void processShell()
             }
         }
         sprintf(str, "pidID of %s\t: %p\r\n", tcb[taskToPrint].name, tcb[taskToPrint].pid);
-        putsUart0(str);
+        uartPuts(str);
         guiAlignment();
     }
     if (isCommand(&data, "run", 1))
     {
-        uint8_t task;
+        uint8_t task = NO_TASK;
         char *firstArgument = getFieldString(&data, 1);
         for(i = 0; i<MAX_TASKS; i++)
         {
@@ -672,11 +2286,18 @@ void processShell()
                 break;
             }
         }
-        if(tcb[task].state == STATE_HOLD)
+        if(task != NO_TASK && tcb[task].state == STATE_HOLD)
         {
-            restartThread(tcb[task].pFn);
+            if(restartThread(tcb[task].pFn))
+            {
+                uartPuts("\r Task Restarted\r\n");
+            }
+            else
+            {
+                sprintf(str, "\r No room for a %u byte stack\r\n", tcb[task].stackSize);
+                uartPuts(str);
+            }
         }
-        putsUart0("\r Task Restarted\r\n");
     }
     if (isCommand(&data, "kill", 1))
     {
@@ -691,111 +2312,353 @@ void processShell()
             }
         }
         destroyThread(tcb[task].pFn);
-        putsUart0("\r Task Killed\r\n");
+        uartPuts("\r Task Killed\r\n");
     }
     // ps calculations
     if (isCommand(&data, "ps", 0))
     {
-        putsUart0("----------------------------------------------------\r\n");
-        sprintf(str, "|TaskPID\t|Name|\t|CPU Time|\t|\r\n");
-        putsUart0(str);
-        putsUart0("----------------------------------------------------\r\n");
+        char line[80], pct[8];
+        uint32_t size;
+        uartPuts("--------------------------------------------------------------------\r\n");
+        sprintf(line, "|TaskPID\t|Name|\t|CPU Time|\t|Slices| |Miss| |Over| |Stack| |Peak| |Free|\r\n");
+        uartPuts(line);
+        uartPuts("--------------------------------------------------------------------\r\n");
 
-        uint64_t totalTime = 0, taskTime[MAX_TASKS], temptime[MAX_TASKS], local1;
-        uint32_t temp1[MAX_TASKS], temp2[MAX_TASKS];
-        uint8_t local = !bufferBlock;
         for(i = 0; i<MAX_TASKS; i++)
         {
-            totalTime += taskCycle[local][i];
+            if (tcb[i].state == STATE_INVALID)
+                continue;
+            sprintf(line, " %d\t\t%-16s%s\t\t", tcb[i].pid, tcb[i].name, cpuPercent(i, pct));
+            uartPuts(line);
+            sprintf(line, "%8u  ", tcb[i].slices);
+            uartPuts(line);
+            if (tcb[i].period != 0)
+                sprintf(line, "%5u  ", tcb[i].deadlineMisses);
+            else
+                sprintf(line, "    -  ");
+            uartPuts(line);
+            if (tcb[i].budget != 0)
+                sprintf(line, "%5u%c ", tcb[i].overruns, tcb[i].state == STATE_THROTTLED ? 'H'
+                        : (tcb[i].demoted ? 'D' : ' '));
+            else
+                sprintf(line, "    -  ");
+            uartPuts(line);
+            // usable stack excludes the MPU guard at the bottom of the block
+            if (tcb[i].stack != 0)
+            {
+                size = tcb[i].stackSize - GUARD_BYTES(tcb[i].stackSize);
+                sprintf(line, "%5u  %5u  %5u\r\n", size, tcb[i].stackPeak, size - tcb[i].stackPeak);
+            }
+            else
+                sprintf(line, "    -      -      -\r\n");
+            uartPuts(line);
+
+        }
+        guiAlignment();
+        uartPuts("-------------------------------------------------\r\n");
+        valid = true;
+    }
+
+    // top [n]: the run time stats every CPU window, n times or until a key
+    if (isCommand(&data, "top", 0))
+    {
+        char pct[8];
+        uint8_t pass, passes = 10, k;
+        if (data.fieldCount > 1)
+            passes = getFieldInteger(&data, 1);
+        for (pass = 0; pass < passes && rxHead == rxTail; pass++)
+        {
+            uartPuts("\033[2J\033[H");
+            sprintf(str, "window %u ms, tick %u\r\n", cpuWindow, tickCount);
+            uartPuts(str);
+            uartPuts("Name               CPU%  Switches  Voluntary  Preempted  MaxLat(us)  Jitter max/avg(us)  Blocked(ms)\r\n");
+            for (i = 0; i < MAX_TASKS; i++)
+            {
+                if (tcb[i].state == STATE_INVALID)
+                    continue;
+                sprintf(str, "%-16s%s  ", tcb[i].name, cpuPercent(i, pct));
+                uartPuts(str);
+                sprintf(str, "%8u  %9u  %9u  %10u ", tcb[i].switches, tcb[i].voluntary,
+                        tcb[i].preempted, tcb[i].worstLatency / 40);
+                uartPuts(str);
+                // worst/average release jitter of sleepUntil tasks
+                if (tcb[i].releases != 0)
+                    sprintf(str, " %9u/%-8u", tcb[i].jitterWorstUs, tcb[i].jitterTotalUs / tcb[i].releases);
+                else
+                    sprintf(str, "         -/-       ");
+                uartPuts(str);
+                // waits per semaphore, only the ones the task used
+                for (k = 1; k < MAX_SEMAPHORES; k++)
+                {
+                    if (semBlockedUs[i][k] != 0)
+                    {
+                        sprintf(str, " s%u:%u", k, semBlockedUs[i][k] / 1000);
+                        uartPuts(str);
+                    }
+                }
+                uartPuts("\r\n");
+            }
+            if (pass + 1 < passes)
+                sleep(cpuWindow);
         }
-        for(i = 0; i<MAX_TASKS; i++)
+        // a key that stopped the refresh is not a command
+        __asm("     CPSID I");
+        rxTail = rxHead;
+        rxLines = 0;
+        __asm("     CPSIE I");
+        guiAlignment();
+        valid = true;
+    }
+
+    // quantum [level|task ticks]: show or set time slices, a task quantum of 0
+    // goes back to its level's
+    if (isCommand(&data, "quantum", 0))
+    {
+        uint8_t ticks, k;
+        if (data.fieldCount > 2)
+        {
+            ticks = getFieldInteger(&data, 2);
+            if (data.fieldType[1] == NUMBER)
+            {
+                k = getFieldInteger(&data, 1);
+                if (k < MAX_PRIORITIES && ticks > 0)
+                    priorityQuantum[k] = ticks;
+            }
+            else
+            {
+                for (k = 0; k < MAX_TASKS; k++)
+                {
+                    if (tcb[k].state != STATE_INVALID && strCompare(getFieldString(&data, 1), tcb[k].name))
+                        tcb[k].quantum = ticks;
+                }
+            }
+        }
+        uartPuts("level  ");
+        for (k = 0; k < MAX_PRIORITIES; k++)
+        {
+            sprintf(str, "%4u", priorityQuantum[k]);
+            uartPuts(str);
+        }
+        uartPuts("\r\n");
+        for (k = 0; k < MAX_TASKS; k++)
         {
-            local1 = taskCycle[local][i];
+            if (tcb[k].state != STATE_INVALID && tcb[k].quantum != 0)
+            {
+                sprintf(str, "%-16s%4u\r\n", tcb[k].name, tcb[k].quantum);
+                uartPuts(str);
+            }
+        }
+        guiAlignment();
+        valid = true;
+    }
 
-            temptime[i] = (local1*100000);
-            taskTime[i] = temptime[i]/totalTime;
-            temp1[i] = taskTime[i]/1000;
-            temp2[i] = taskTime[i]%100;
+    // budget [task ticks period [hold]]: show or set CPU budgets, 0 ticks
+    // removes the limit
+    if (isCommand(&data, "budget", 0))
+    {
+        uint8_t k;
+        if (data.fieldCount > 3)
+        {
+            for (k = 0; k < MAX_TASKS; k++)
+            {
+                if (tcb[k].state != STATE_INVALID && strCompare(getFieldString(&data, 1), tcb[k].name))
+                {
+                    setThreadBudget(tcb[k].pFn, getFieldInteger(&data, 2), getFieldInteger(&data, 3),
+                                    (data.fieldCount > 4 && strCompare(getFieldString(&data, 4), "hold"))
+                                    ? BUDGET_HOLD : BUDGET_DEMOTE);
+                }
+            }
+        }
+        uartPuts("Name              Budget  Period  Left  Action  Overruns\r\n");
+        for (k = 0; k < MAX_TASKS; k++)
+        {
+            if (tcb[k].state != STATE_INVALID && tcb[k].budget != 0)
+            {
+                sprintf(str, "%-16s%8u%8u%6u  ", tcb[k].name, tcb[k].budget, tcb[k].budgetPeriod,
+                        tcb[k].budgetLeft);
+                uartPuts(str);
+                sprintf(str, "%-6s%10u\r\n", tcb[k].budgetAction == BUDGET_HOLD ? "hold" : "demote",
+                        tcb[k].overruns);
+                uartPuts(str);
+            }
+        }
+        guiAlignment();
+        valid = true;
+    }
 
-            sprintf(str, " %d\t\t%s\t\t%d.%d\r\n", tcb[i].pid, tcb[i].name,temp1[i],temp2[i]);
-            putsUart0(str);
+    // window [ms]: show or set the CPU usage window
+    if (isCommand(&data, "window", 0))
+    {
+        if (data.fieldCount > 1 && getFieldInteger(&data, 1) > 0)
+            cpuWindow = getFieldInteger(&data, 1);
+        sprintf(str, "cpu window %u ms\r\n", cpuWindow);
+        uartPuts(str);
+        guiAlignment();
+        valid = true;
+    }
 
+    if (isCommand(&data, "meminfo", 0))
+    {
+        char line[80];
+        uint32_t used = 0, largest = stackLargestFree();
+        uartPuts("----------------------------------------------------\r\n");
+        uartPuts("|Task\t\t|Base|\t\t|Size|\r\n");
+        uartPuts("----------------------------------------------------\r\n");
+        for(i = 0; i < MAX_TASKS; i++)
+        {
+            if(tcb[i].state != STATE_INVALID && tcb[i].stack != 0)
+            {
+                sprintf(line, "%-16s0x%08x\t%5u\r\n", tcb[i].name, (uint32_t)tcb[i].stack, tcb[i].stackSize);
+                uartPuts(line);
+                used += tcb[i].stackSize;
+            }
+        }
+        uartPuts("----------------------------------------------------\r\n");
+        sprintf(line, "heap    %5u bytes at 0x%08x\r\n", HEAP_END - HEAP_BASE, HEAP_BASE);
+        uartPuts(line);
+        sprintf(line, "used    %5u\r\nfree    %5u\r\nlargest %5u\r\n", used,
+                HEAP_END - HEAP_BASE - used, largest);
+        uartPuts(line);
+        // share of the free memory that cannot be handed out as one block
+        sprintf(line, "frag    %5u%%\r\n", (used == HEAP_END - HEAP_BASE) ? 0 :
+                100 - (largest * 100) / (HEAP_END - HEAP_BASE - used));
+        uartPuts(line);
+        uartPuts("pages   ");
+        for(i = 0; i < HEAP_PAGES; i++)
+        {
+            uartPutc(pageOwner[i] == NO_TASK ? '.' : 'A' + pageOwner[i]);
         }
+        uartPuts("\r\n");
         guiAlignment();
-        putsUart0("-------------------------------------------------\r\n");
+        valid = true;
     }
 
 //semaphore ipcs
     if (isCommand(&data, "ipcs", 0))
     {
         uint8_t i,j;
-        putsUart0("----------------------------------------------------\r\n");
-        sprintf(str, "|Semaphore\t|Count|\t|QueueSize|\t|Queue[0]:Queue[1]|\r\n");
-        putsUart0(str);
-        putsUart0("----------------------------------------------------\r\n");
+        uartPuts("----------------------------------------------------\r\n");
+        sprintf(str, "|Semaphore\t|Count|\t|QueueSize|\t|Queue|\r\n");
+        uartPuts(str);
+        uartPuts("----------------------------------------------------\r\n");
         guiAlignment();
-        for(i=0;i<5;i++)
+        for(i=0;i<MAX_SEMAPHORES;i++)
         {
             sprintf(str, "%5.1d\t\t",i);
-            putsUart0(str);
+            uartPuts(str);
             sprintf(str, "%2.1d\t", semaphores[i].count);
-            putsUart0(str);
-            sprintf(str, " %2.1d\t\t", semaphores[i].queueSize);
-            putsUart0(str);
-            if(semaphores[i].queueSize == 0)
+            uartPuts(str);
+            sprintf(str, " %2.1d\t\t", semaphores[i].queue.size);
+            uartPuts(str);
+            if(semaphores[i].queue.size == 0)
             {
-                putsUart0("none\r\n");
+                uartPuts("none");
             }
-            if(semaphores[i].queueSize>0)
+            for(j=semaphores[i].queue.head;j!=NO_TASK;j=tcb[j].waitNext)
             {
-                for(j=0;j<MAX_TASKS;j++)
-                {
-                    if(j==semaphores[i].processQueue[0])
-                    {
-                        putsUart0(tcb[j].name);
-                        putsUart0("\r\n");
-                    }
-                }
+                uartPuts(tcb[j].name);
+                uartPuts(" ");
+            }
+            uartPuts("\r\n");
+        }
+        uartPuts("-------------------------------------------------\r\n");
+        uartPuts("|Mutex\t|Owner|\t|Waiters|\t|Errors|\t|Next|\r\n");
+        uartPuts("----------------------------------------------------\r\n");
+        for(i=0;i<MAX_MUTEXES;i++)
+        {
+            sprintf(str, "%5.1d\t\t", i);
+            uartPuts(str);
+            uartPuts(mutexes[i].owner == NO_TASK ? "none" : tcb[mutexes[i].owner].name);
+            sprintf(str, "\t%2.1d\t\t%2.1d\t\t", mutexes[i].queue.size, mutexes[i].errors);
+            uartPuts(str);
+            uartPuts(mutexes[i].queue.head == NO_TASK ? "none" : tcb[mutexes[i].queue.head].name);
+            uartPuts("\r\n");
+        }
+        uartPuts("-------------------------------------------------\r\n");
+        uartPuts("|Mailbox\t|Msgs|\t|Senders|\t|Receivers|\t|Errors|\r\n");
+        uartPuts("----------------------------------------------------\r\n");
+        for(i=0;i<MAX_MAILBOXES;i++)
+        {
+            sprintf(str, "%5.1d\t\t%2.1d\t", i, mailboxes[i].count);
+            uartPuts(str);
+            sprintf(str, "%2.1d\t\t%2.1d\t\t", mailboxes[i].senders.size, mailboxes[i].receivers.size);
+            uartPuts(str);
+            sprintf(str, "%2.1d\r\n", mailboxes[i].errors);
+            uartPuts(str);
+        }
+        uartPuts("-------------------------------------------------\r\n");
+        uartPuts("|Flags\t|Value|\t\t|Waiters|\r\n");
+        uartPuts("----------------------------------------------------\r\n");
+        for(i=0;i<MAX_FLAG_GROUPS;i++)
+        {
+            sprintf(str, "%5.1d\t\t%08x\t", i, flagGroups[i].flags);
+            uartPuts(str);
+            if(flagGroups[i].queue.size == 0)
+            {
+                uartPuts("none");
+            }
+            for(j=flagGroups[i].queue.head;j!=NO_TASK;j=tcb[j].waitNext)
+            {
+                uartPuts(tcb[j].name);
+                uartPuts(" ");
             }
-//            for(i=0;i<MAX_TASKS;i++)
-//            {
-//
-//                if(i==semaphores[task].processQueue[0])
-//                {
-//                    putsUart0(tcb[queue].name);
-//                    putsUart0("\r\n");
-//                }
-//            }
-//
-//            sprintf(str, "%s:%s \r\n", tcb[semaphores[i].processQueue[0]].name, tcb[semaphores[i].processQueue[1]].name);
-//
-//            putsUart0(str);
-//            valid = true;
-//            guiAlignment();
-        }
-        putsUart0("-------------------------------------------------\r\n");
+            uartPuts("\r\n");
+        }
+        uartPuts("-------------------------------------------------\r\n");
+        // pool map: . free, q queued in a mailbox, letter = owning task
+        uartPuts("buffers ");
+        for(i=0;i<BUFFER_COUNT;i++)
+        {
+            if(bufferOwner[i] == NO_TASK)
+                uartPutc('.');
+            else if(bufferOwner[i] == BUFFER_QUEUED)
+                uartPutc('q');
+            else
+                uartPutc('A' + bufferOwner[i]);
+        }
+        sprintf(str, "  errors %d\r\n", bufferErrors);
+        uartPuts(str);
         guiAlignment();
     }
     if (!valid)
     {
-        putsUart0("Invalid command\n");
+        uartPuts("Invalid command\n");
     }
 }
 
+// let only tasks created for floating point use the FPU, the ISB makes the
+// change visible to pendSVIsr restoring S16-S31 right after taskSwitch
+void fpuAccess(uint8_t task)
+{
+    if (tcb[task].fpu)
+        NVIC_CPAC_R |= NVIC_CPAC_CP10_FULL | NVIC_CPAC_CP11_FULL;
+    else
+        NVIC_CPAC_R &= ~(NVIC_CPAC_CP10_FULL | NVIC_CPAC_CP11_FULL);
+    __asm("     ISB");
+}
+
 // REQUIRED: modify this function to start the operating system
 // by calling scheduler, setting PSP, ASP bit, and PC
 void startRtos()
 {
     taskCurrent = rtosScheduler();
-    TIMER1_TAV_R = 0;
-    TIMER1_CTL_R |= TIMER_CTL_TAEN;
     tcb[taskCurrent].state = STATE_READY;
-    setPSP(tcb[taskCurrent].sp);
+    tcb[taskCurrent].switches++;
+    tcb[taskCurrent].sliceLeft = taskQuantum(taskCurrent);
+    tcb[taskCurrent].slices++;
+    switchStamp = DWT_CYCCNT_R;
+    windowStart = tickCount;
+    rtosStarted = true;
+    NVIC_MPU_BASE_R = tcb[taskCurrent].mpuBase;
+    NVIC_MPU_ATTR_R = tcb[taskCurrent].mpuAttr;
+    fpuAccess(taskCurrent);
+    setPSP(tcb[taskCurrent].spInit);
     setASP(2);
     fn task = tcb[taskCurrent].pFn;
     task();
 }
 
+#ifndef HOST_PORT
 // REQUIRED: modify this function to yield execution back to scheduler using pendsv
 void yield()
 {
@@ -808,7 +2671,7 @@ void sleep(uint32_t tick)
 {
     __asm("     SVC #32");
 }
-aaa
+
 // REQUIRED: modify this function to wait a semaphore using pendsv
 void wait(int8_t s)
 {
@@ -821,42 +2684,163 @@ void post(int8_t s)
     __asm("     SVC #64");
 }
 
+// lock a mutex, blocking while another task owns it
+// the owner inherits the priority of its highest priority waiter
+void lock(int8_t m)
+{
+    __asm("     SVC #17");
+}
+
+// unlock a mutex owned by the caller, the best waiter becomes the owner
+void unlock(int8_t m)
+{
+    __asm("     SVC #18");
+}
+
+// take a buffer from the pool, blocking until one is free
+void getBuffer(void **buffer)
+{
+    __asm("     SVC #19");
+}
+
+// return a buffer the caller owns to the pool
+void freeBuffer(void *buffer)
+{
+    __asm("     SVC #20");
+}
+
+// pass an owned buffer to a mailbox, blocking while it is full
+// the buffer must not be touched by the sender afterwards
+void send(uint8_t box, void *msg)
+{
+    __asm("     SVC #21");
+}
+
+// take the oldest message from a mailbox, blocking while it is empty
+// the caller owns the buffer and must send or free it
+void receive(uint8_t box, void **msg)
+{
+    __asm("     SVC #22");
+}
+
+// block until the mask is satisfied (FLAGS_ANY or FLAGS_ALL, | FLAGS_CLEAR to
+// consume the bits), *result gets the mask bits that were set
+void waitFlags(uint8_t group, uint32_t mask, uint8_t options, uint32_t *result)
+{
+    __asm("     SVC #23");
+}
+
+// set bits in a group, waking every task they satisfy
+void setFlags(uint8_t group, uint32_t mask)
+{
+    __asm("     SVC #24");
+}
+
+// sleep until *lastWake + period and advance *lastWake by period, so a loop
+// runs at a fixed rate however long its body takes
+// set *lastWake = tickCount once before the loop, a late caller does not block
+// and stays on the same grid
+void sleepUntil(uint32_t *lastWake, uint32_t period)
+{
+    __asm("     SVC #25");
+}
+#endif
+
+// debounce timer expired: report what changed since the last stable state
+// and listen for edges again
+void buttonDebounced()
+{
+    uint8_t buttons = readPbs();
+    uint8_t pressed = buttons & ~buttonState;
+    buttonState = buttons;
+    if (pressed)
+        flagsSet(buttonFlags, pressed);
+    GPIO_PORTC_ICR_R = PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;
+    GPIO_PORTD_ICR_R = PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK;
+    GPIO_PORTC_IM_R |= PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;
+    GPIO_PORTD_IM_R |= PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK;
+}
+
 // REQUIRED: modify this function to add support for the system timer
 // REQUIRED: in preemptive code, add code to request task switch
 void systickIsr()
 {
-    static uint32_t switchTime = 0;
     int i;
-    if(switchTime==1000)
+    bool overrun;
+#ifdef BENCHMARK
+    benchTickCycles = DWT_CYCCNT_R;
+#endif
+    TRACE_EVENT(TRACE_TICK, taskCurrent, 0);
+    tickCount++;
+    // a periodic job still running past its deadline is counted right away
+    if(tcb[taskCurrent].period != 0 && !tcb[taskCurrent].jobDone && !tcb[taskCurrent].late
+            && (int32_t)(tickCount - tcb[taskCurrent].absDeadline) > 0)
+    {
+        tcb[taskCurrent].late = true;
+        tcb[taskCurrent].deadlineMisses++;
+    }
+    if(tickCount - windowStart >= cpuWindow)
+    {
+        cpuWindowEnd();
+    }
+    // only the head of the delta list counts down, then every expired
+    // sleeper behind it is moved to the ready lists
+    if(sleepHead != NO_TASK)
     {
-        switchTime=0;
-        bufferBlock ^= 1;
-        for(i=0;i < MAX_TASKS; i++ )
+        if(tcb[sleepHead].ticks > 0)
+            tcb[sleepHead].ticks--;
+        while(sleepHead != NO_TASK && tcb[sleepHead].ticks == 0)
         {
-            taskCycle[bufferBlock][i] = 0;
+            i = sleepHead;
+            sleepHead = tcb[i].sleepNext;
+            tcb[i].state = STATE_READY;
+            readyInsert(i);
         }
-
     }
-    switchTime++;
-    for(i=0;i<MAX_TASKS;i++)
+    if(debounceTicks != 0 && --debounceTicks == 0)
+    {
+        buttonDebounced();
+    }
+    overrun = budgetCharge(taskCurrent);
+    if (budgetTasks != 0 && (int32_t)(tickCount - nextReplenish) >= 0)
+        budgetReplenish();
+    // when the running task's slice is over it gives way to the next task at
+    // its level, if there is one, or round robin moves on, a task alone at
+    // its level just starts another slice
+    if(tcb[taskCurrent].sliceLeft > 0 && --tcb[taskCurrent].sliceLeft == 0)
     {
+        if(scheduler == RR)
         {
-            if(tcb[i].ticks>0 && tcb[i].state == STATE_DELAYED)
-            {
-                tcb[i].ticks--;
-                if(tcb[i].ticks == 0)
-                {
-                    tcb[i].state = STATE_READY;
-                }
-            }
+            rescheduleNeeded = true;
+        }
+        else if(tcb[taskCurrent].readyNext != NO_TASK && tcb[taskCurrent].readyNext != taskCurrent)
+        {
+            readyRotate(taskCurrent);
+            rescheduleNeeded = true;
+        }
+        else
+        {
+            tcb[taskCurrent].sliceLeft = taskQuantum(taskCurrent);
+            tcb[taskCurrent].slices++;
         }
     }
-    if(preemption)
+    if((preemption && rescheduleNeeded) || overrun)
     {
         NVIC_INT_CTRL_R |= NVIC_INT_CTRL_PEND_SV;
     }
 }
 
+// any pushbutton edge on port C or D, both vectors point here
+// bounces are ignored until the debounce timer samples the buttons
+void pushButtonIsr()
+{
+    GPIO_PORTC_IM_R &= ~(PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK);
+    GPIO_PORTD_IM_R &= ~(PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK);
+    GPIO_PORTC_ICR_R = PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;
+    GPIO_PORTD_ICR_R = PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK;
+    debounceTicks = DEBOUNCE_TICKS;
+}
+
 
 
 
@@ -880,9 +2864,36 @@ void initHw()
     SYSCTL_RCGCGPIO_R |= SYSCTL_RCGCGPIO_R0;
     SYSCTL_RCGCGPIO_R |= SYSCTL_RCGCGPIO_R2;
     SYSCTL_RCGCGPIO_R |= SYSCTL_RCGCGPIO_R5|SYSCTL_RCGCGPIO_R4|SYSCTL_RCGCGPIO_R3;
-    SYSCTL_RCGCTIMER_R |= SYSCTL_RCGCTIMER_R1; // Timer1
     _delay_cycles(3);
 
+    // FP context is stacked lazily and only for tasks that used it, so
+    // integer-only switches stay the same size, the FPU itself is only
+    // enabled (CPACR) while a createFpuThread task runs
+    NVIC_FPCC_R |= NVIC_FPCC_ASPEN | NVIC_FPCC_LSPEN;
+    NVIC_SYS_HND_CTRL_R |= NVIC_SYS_HND_CTRL_USAGE;
+
+    // free running cycle counter for benchmarks
+    CORE_DEMCR_R |= CORE_DEMCR_TRCENA;
+    DWT_CYCCNT_R = 0;
+    DWT_CTRL_R |= DWT_CTRL_CYCCNTENA;
+
+    // MPU with the default map as background, region 7 is the stack guard
+    // of the running task and is loaded on every switch
+    NVIC_MPU_CTRL_R = NVIC_MPU_CTRL_PRIVDEFEN | NVIC_MPU_CTRL_ENABLE;
+    NVIC_SYS_HND_CTRL_R |= NVIC_SYS_HND_CTRL_MEM;
+
+    // the faults stay at priority 0 and the kernel's handlers (SVC, PendSV,
+    // SysTick, pushbuttons, UART0) share priority 1, so they still never nest
+    // but a guard hit while pendSVIsr saves a context is a MemManage fault
+    // instead of a HardFault
+    NVIC_SYS_PRI1_R &= ~(NVIC_SYS_PRI1_MEM_M | NVIC_SYS_PRI1_USAGE_M);
+    NVIC_SYS_PRI2_R = (NVIC_SYS_PRI2_R & ~NVIC_SYS_PRI2_SVC_M) | (KERNEL_PRIORITY << NVIC_SYS_PRI2_SVC_S);
+    NVIC_SYS_PRI3_R = (NVIC_SYS_PRI3_R & ~(NVIC_SYS_PRI3_TICK_M | NVIC_SYS_PRI3_PENDSV_M))
+                    | (KERNEL_PRIORITY << NVIC_SYS_PRI3_TICK_S) | (KERNEL_PRIORITY << NVIC_SYS_PRI3_PENDSV_S);
+    NVIC_PRI4_R = (NVIC_PRI4_R & ~(NVIC_PRI4_INT18_M | NVIC_PRI4_INT19_M))
+                | (KERNEL_PRIORITY << NVIC_PRI4_INT18_S) | (KERNEL_PRIORITY << NVIC_PRI4_INT19_S);
+    NVIC_PRI5_R = (NVIC_PRI5_R & ~NVIC_PRI5_INT21_M) | (KERNEL_PRIORITY << NVIC_PRI5_INT21_S);
+
     // Configure LED and pushbutton pins
 
     GPIO_PORTD_LOCK_R = 0x4C4F434B;
@@ -903,48 +2914,105 @@ void initHw()
     GPIO_PORTC_PUR_R |= PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;//pullups;
     GPIO_PORTD_PUR_R |= PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK ;
 
-    // NVIC_EN0_R |= 1 << (INT_-16)
+    // interrupt on both edges of every button
+    GPIO_PORTC_IS_R &= ~(PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK);
+    GPIO_PORTD_IS_R &= ~(PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK);
+    GPIO_PORTC_IBE_R |= PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;
+    GPIO_PORTD_IBE_R |= PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK;
+    GPIO_PORTC_ICR_R = PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;
+    GPIO_PORTD_ICR_R = PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK;
+    GPIO_PORTC_IM_R |= PUSH_BUTTON0_MASK | PUSH_BUTTON1_MASK | PUSH_BUTTON2_MASK | PUSH_BUTTON3_MASK;
+    GPIO_PORTD_IM_R |= PUSH_BUTTON4_MASK | PUSH_BUTTON5_MASK;
+    NVIC_EN0_R |= 1 << (INT_GPIOC-16) | 1 << (INT_GPIOD-16);
+    buttonState = readPbs();
 
     GPIO_PORTD_CR_R = 0;
 
 
     //systick timer
     NVIC_ST_CTRL_R = 0; // clear before configuring
-    NVIC_ST_RELOAD_R = 40000; // reload value at 1kHz
+    NVIC_ST_RELOAD_R = TICK_CYCLES - 1; // reload value at 1kHz
     NVIC_ST_CURRENT_R = 0;    // clear current
     NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC | NVIC_ST_CTRL_INTEN | NVIC_ST_CTRL_ENABLE; // enable system clock, interrupt, timer
+}
 
-    //Timer1 config
-    TIMER1_CTL_R &= ~TIMER_CTL_TAEN;                 // turn-off timer before reconfiguring
-    TIMER1_CFG_R = TIMER_CFG_32_BIT_TIMER;           // configure as 32-bit timer (A+B)
-    TIMER1_TAMR_R = TIMER_TAMR_TAMR_1_SHOT | TIMER_TAMR_TACDIR; // one shot and count up
+// called first by pendSVIsr (asm), before any context is saved
+// picks the next task and returns false if it is the running one, in which
+// case pendSVIsr returns straight away
+bool scheduleNext()
+{
+    rescheduleNeeded = false;
+    taskNext = rtosScheduler();
+    if (taskNext != taskCurrent)
+        return true;
+    // taskSwitch is skipped, a yield that kept the task is over
+    switchYield = false;
+    return false;
 }
 
 // REQUIRED: in coop and preemptive, modify this function to add support for task switching
 // REQUIRED: process UNRUN and READY tasks differently
-void pendSVIsr()
+// called once per switch by pendSVIsr (asm) with the sp of the outgoing task
+// after R4-R11 are saved, returns the sp of the task to restore
+// UNRUN tasks already hold an initial frame so they take the same path
+void *taskSwitch(void *sp)
 {
-    pushReglist();
-    tcb[taskCurrent].sp = getPSP();
-
-    TIMER1_CTL_R &= ~TIMER_CTL_TAEN;
-    taskCycle[bufferBlock][taskCurrent] += TIMER1_TAV_R;
-    taskCurrent = rtosScheduler();
-    TIMER1_TAV_R = 0;
-    TIMER1_CTL_R |= TIMER_CTL_TAEN;
-
-    if(tcb[taskCurrent].state == STATE_READY)
+    uint8_t previous = taskCurrent;
+    uint32_t now = DWT_CYCCNT_R;
+    tcb[taskCurrent].sp = sp;
+    tcb[taskCurrent].cycles += now - switchStamp;
+    switchStamp = now;
+
+    taskCurrent = taskNext;
+    // the context just saved belongs to a task that destroyed itself
+    if (stackReclaim == previous)
     {
-        setPSP(tcb[taskCurrent].sp);
-        popReglist();
+        stackFree(previous);
+        stackReclaim = NO_TASK;
     }
-    else // for the tasks that are never run before
+    // a periodic job is over once its task leaves the ready lists
+    if (tcb[previous].period != 0 && tcb[previous].readyNext == NO_TASK && !tcb[previous].jobDone
+            && tcb[previous].state != STATE_THROTTLED)
     {
-        int XPSR = 0x01000000;
-        setPSP(tcb[taskCurrent].sp);
-        tcb[taskCurrent].state = STATE_READY;
-        createHWpushContext(XPSR, tcb[taskCurrent].pFn);
+        if (!tcb[previous].late && (int32_t)(tickCount - tcb[previous].absDeadline) > 0)
+            tcb[previous].deadlineMisses++;
+        tcb[previous].jobDone = true;
+    }
+    if (taskCurrent != previous)
+    {
+        // a task still in the ready lists was preempted unless it yielded,
+        // either way its wait to run again starts now
+        if (tcb[previous].readyNext != NO_TASK)
+            tcb[previous].readyStamp = now;
+        if (tcb[previous].readyNext == NO_TASK || switchYield)
+            tcb[previous].voluntary++;
+        else
+            tcb[previous].preempted++;
+        tcb[taskCurrent].switches++;
+        // a task that blocked or yielded is done with its slice, one that was
+        // preempted keeps what is left of it
+        if (tcb[previous].readyNext == NO_TASK || switchYield)
+            tcb[previous].sliceLeft = 0;
+        if (tcb[taskCurrent].sliceLeft == 0)
+        {
+            tcb[taskCurrent].sliceLeft = taskQuantum(taskCurrent);
+            tcb[taskCurrent].slices++;
+        }
+        if (now - tcb[taskCurrent].readyStamp > tcb[taskCurrent].worstLatency)
+            tcb[taskCurrent].worstLatency = now - tcb[taskCurrent].readyStamp;
+        // the delta list wakes on the intended tick, the rest is the wait to run
+        if (tcb[taskCurrent].timedWake)
+            releaseJitter(taskCurrent, now - tcb[taskCurrent].readyStamp);
     }
+    switchYield = false;
+    TRACE_EVENT(TRACE_SWITCH, previous, taskCurrent);
+
+    tcb[taskCurrent].state = STATE_READY;
+    // move the stack guard to the incoming task
+    NVIC_MPU_BASE_R = tcb[taskCurrent].mpuBase;
+    NVIC_MPU_ATTR_R = tcb[taskCurrent].mpuAttr;
+    fpuAccess(taskCurrent);
+    return tcb[taskCurrent].sp;
 }
 
 
@@ -953,17 +3021,25 @@ void pendSVIsr()
 void SVCIsr()
 {
     int *r0ptr, semaphore;
+    uint8_t m, task, b;
+    uint32_t wake;
+    mailbox *mb;
+    void *msg;
     uint32_t *ptr = getSVCnumber();
     uint8_t SVC = (uint8_t)*ptr & 0xFF;
+    TRACE_EVENT(TRACE_SVC, taskCurrent, SVC);
     switch(SVC)
     {
     case YIELD: NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+    switchYield = true;
+    readyRotate(taskCurrent);
     break;
     case SLEEP:
         //tcb[taskCurrent].ticks = getR0();
         r0ptr = getPSP();
-        tcb[taskCurrent].ticks = *r0ptr;
         tcb[taskCurrent].state = STATE_DELAYED;
+        readyRemove(taskCurrent);
+        sleepInsert(taskCurrent, *r0ptr);
         NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
         break;
     case WAIT:
@@ -977,26 +3053,237 @@ void SVCIsr()
         else
         {
             tcb[taskCurrent].state = STATE_BLOCKED;
-            semaphores[semaphore].processQueue[semaphores[semaphore].queueSize] = taskCurrent;
-            semaphores[semaphore].queueSize++;
+            readyRemove(taskCurrent);
+            queueInsert(&semaphores[semaphore].queue, taskCurrent);
+            tcb[taskCurrent].blockStamp = DWT_CYCCNT_R;
+            TRACE_EVENT(TRACE_BLOCK, taskCurrent, semaphore);
             NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
         }
         break;
     case POST:
         r0ptr = getPSP();
         semaphore = *r0ptr;
-        semaphores[semaphore].count++;
-        if(semaphores[semaphore].queueSize > 0)
+        task = queuePop(&semaphores[semaphore].queue);
+        if(task != NO_TASK)
         {
-            tcb[semaphores[semaphore].processQueue[0]].state = STATE_READY;
-            semaphores[semaphore].processQueue[0] = semaphores[semaphore].processQueue[1];
-            semaphores[semaphore].processQueue[1] = 0;
-            semaphores[semaphore].queueSize--;
-            semaphores[semaphore].count--;
+            // the count passes straight to the woken task
+            semaphoreWaited(task, semaphore);
+            tcb[task].s = semaphore;
+            tcb[task].state = STATE_READY;
+            readyInsert(task);
+            TRACE_EVENT(TRACE_UNBLOCK, task, semaphore);
+        }
+        else
+        {
+            semaphores[semaphore].count++;
+        }
+        break;
+    case LOCK:
+        r0ptr = getPSP();
+        m = *r0ptr;
+        if(mutexes[m].owner == NO_TASK)
+        {
+            mutexes[m].owner = taskCurrent;
+            if(mutexes[m].protocol == MUTEX_CEILING)
+                changePriority(taskCurrent, mutexPriority(taskCurrent));
+        }
+        else if(mutexes[m].owner == taskCurrent)
+        {
+            // a recursive lock would wait on itself forever, refuse it
+            mutexes[m].errors++;
+        }
+        else
+        {
+            tcb[taskCurrent].state = STATE_BLOCKED;
+            readyRemove(taskCurrent);
+            tcb[taskCurrent].mutexWait = m;
+            queueInsert(&mutexes[m].queue, taskCurrent);
+            // lend our priority to the owner and whoever it is waiting behind
+            propagatePriority(mutexes[m].owner);
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+        }
+        break;
+    case UNLOCK:
+        r0ptr = getPSP();
+        m = *r0ptr;
+        if(mutexes[m].owner != taskCurrent)
+        {
+            mutexes[m].errors++;
+        }
+        else
+        {
+            mutexRelease(m);
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+        }
+        break;
+    case GETBUF:
+        r0ptr = getPSP();
+        if(bufferFree != NO_BUFFER)
+        {
+            b = bufferFree;
+            bufferFree = bufferNext[b];
+            bufferOwner[b] = taskCurrent;
+            *(void **)r0ptr[0] = bufferPool[b];
+        }
+        else
+        {
+            tcb[taskCurrent].state = STATE_BLOCKED;
+            readyRemove(taskCurrent);
+            tcb[taskCurrent].msgDest = (void **)r0ptr[0];
+            queueInsert(&bufferQueue, taskCurrent);
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+        }
+        break;
+    case FREEBUF:
+        r0ptr = getPSP();
+        b = bufferIndex((void *)r0ptr[0]);
+        if(b == NO_BUFFER || bufferOwner[b] != taskCurrent)
+            bufferErrors++;
+        else
+            bufferRelease(b);
+        break;
+    case SEND:
+        r0ptr = getPSP();
+        mb = &mailboxes[r0ptr[0]];
+        msg = (void *)r0ptr[1];
+        b = bufferIndex(msg);
+        if(b == NO_BUFFER || bufferOwner[b] != taskCurrent)
+        {
+            mb->errors++;
+            break;
+        }
+        task = queuePop(&mb->receivers);
+        if(task != NO_TASK)
+        {
+            // a waiting receiver takes the buffer without it being queued
+            bufferOwner[b] = task;
+            *tcb[task].msgDest = msg;
+            tcb[task].state = STATE_READY;
+            readyInsert(task);
+        }
+        else if(mb->count < MAILBOX_DEPTH)
+        {
+            mailboxPut(r0ptr[0], msg);
+        }
+        else
+        {
+            tcb[taskCurrent].state = STATE_BLOCKED;
+            readyRemove(taskCurrent);
+            tcb[taskCurrent].msgOut = msg;
+            queueInsert(&mb->senders, taskCurrent);
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+        }
+        break;
+    case RECEIVE:
+        r0ptr = getPSP();
+        mb = &mailboxes[r0ptr[0]];
+        if(mb->count > 0)
+        {
+            msg = mb->msg[mb->head];
+            mb->head = (mb->head + 1) % MAILBOX_DEPTH;
+            mb->count--;
+            bufferOwner[bufferIndex(msg)] = taskCurrent;
+            *(void **)r0ptr[1] = msg;
+            // the freed slot goes to the first blocked sender
+            task = queuePop(&mb->senders);
+            if(task != NO_TASK)
+            {
+                mailboxPut(r0ptr[0], tcb[task].msgOut);
+                tcb[task].state = STATE_READY;
+                readyInsert(task);
+            }
+        }
+        else
+        {
+            tcb[taskCurrent].state = STATE_BLOCKED;
+            readyRemove(taskCurrent);
+            tcb[taskCurrent].msgDest = (void **)r0ptr[1];
+            queueInsert(&mb->receivers, taskCurrent);
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+        }
+        break;
+    case WAITFLAGS:
+        r0ptr = getPSP();
+        m = r0ptr[0];
+        if(flagsMatch(flagGroups[m].flags, r0ptr[1], r0ptr[2]))
+        {
+            *(uint32_t *)r0ptr[3] = flagGroups[m].flags & r0ptr[1];
+            if(r0ptr[2] & FLAGS_CLEAR)
+                flagGroups[m].flags &= ~r0ptr[1];
+        }
+        else
+        {
+            tcb[taskCurrent].state = STATE_BLOCKED;
+            readyRemove(taskCurrent);
+            tcb[taskCurrent].flagMask = r0ptr[1];
+            tcb[taskCurrent].flagOptions = r0ptr[2];
+            tcb[taskCurrent].flagResult = (uint32_t *)r0ptr[3];
+            queueInsert(&flagGroups[m].queue, taskCurrent);
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
         }
         break;
+    case SETFLAGS:
+        r0ptr = getPSP();
+        flagsSet(r0ptr[0], r0ptr[1]);
+        break;
+    case SLEEPUNTIL:
+        r0ptr = getPSP();
+        wake = *(uint32_t *)r0ptr[0] + r0ptr[1];
+        *(uint32_t *)r0ptr[0] = wake;
+        // differences stay right across tickCount wrapping
+        if ((int32_t)(wake - tickCount) > 0)
+        {
+            tcb[taskCurrent].state = STATE_DELAYED;
+            readyRemove(taskCurrent);
+            sleepInsert(taskCurrent, wake - tickCount);
+            tcb[taskCurrent].timedWake = true;
+            NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+        }
+        else
+        {
+            releaseJitter(taskCurrent, (tickCount - wake) * TICK_CYCLES);
+        }
+        break;
+    }
+    // a post or set that woke a better task preempts the caller now
+    // instead of at the next tick
+    if(preemption && rescheduleNeeded)
+    {
+        NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
     }
 }
+
+// usage fault, e.g. a task not created with createFpuThread used the FPU
+// (NOCP): report it, kill the task and switch away
+void usageFaultIsr()
+{
+    uint32_t status = NVIC_FAULT_STAT_R & 0xFFFF0000;
+    LOG2(LOG_USAGE_FAULT, taskCurrent, status >> 16);
+    NVIC_FAULT_STAT_R = status;
+    destroyThread(tcb[taskCurrent].pFn);
+}
+
+// MPU fault, a task ran into the guard at the bottom of its stack, the
+// hardware could not stack its frame there, or pendSVIsr could not save its
+// context there: report it, kill the task and switch away
+// called by mpuFaultIsr (asm) with the stacked frame and EXC_RETURN
+// from a task, PendSV tail-chains so nothing is unstacked from the bad stack
+// from pendSVIsr (the only handler that writes a task stack), it is resumed
+// at pendSVDone instead of the faulting store and the PendSV pended here
+// runs as it returns
+void mpuFault(uint32_t *frame, uint32_t excReturn)
+{
+    uint32_t status = NVIC_FAULT_STAT_R & 0xFF;
+    LOG3(LOG_MPU_FAULT, taskCurrent, (status & NVIC_FAULT_STAT_MMARV) ? NVIC_MM_ADDR_R : 0, status);
+    NVIC_FAULT_STAT_R = status;
+    if (!(excReturn & EXC_RETURN_THREAD))
+        frame[6] = (uint32_t)pendSVDone & ~1;
+    // pendSVIsr saves the dead context at the top of its stack instead
+    setPSP(tcb[taskCurrent].spInit);
+    destroyThread(tcb[taskCurrent].pFn);
+    NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+}
+
 // REQUIRED: add code to return a value from 0-63 indicating which of 6 PBs are pressed
 uint8_t readPbs()
 {
@@ -1024,10 +3311,17 @@ uint8_t readPbs()
 // the idle task is implemented for this purpose
 void idle()
 {
+    uint8_t check = 0;
     while(true)
     {
+        // one stack per pass keeps the high-water marks current off the switch path
+        stackCheck(check);
+        check = (check + 1) % MAX_TASKS;
         ORANGE_LED = 1;
-        waitMicrosecond(1000);
+        if (tickless)
+            suppressTicks();
+        else
+            waitMicrosecond(1000);
         ORANGE_LED = 0;
         yield();
     }
@@ -1046,10 +3340,11 @@ void idle2()
 
 void flash4Hz()
 {
+    uint32_t lastWake = tickCount;
     while(true)
     {
         GREEN_LED ^= 1;
-        sleep(125);
+        sleepUntil(&lastWake, 125);
     }
 }
 
@@ -1077,29 +3372,22 @@ void lengthyFn()
     uint16_t i;
     while(true)
     {
-        wait(resource);
+        lock(resource);
         for (i = 0; i < 5000; i++)
         {
             partOfLengthyFn();
         }
         RED_LED ^= 1;
-        post(resource);
+        unlock(resource);
     }
 }
 
 void readKeys()
 {
-    uint8_t buttons;
+    uint32_t buttons;
     while(true)
     {
-        wait(keyReleased);
-        buttons = 0;
-        while (buttons == 0)
-        {
-            buttons = readPbs();
-            yield();
-        }
-        post(keyPressed);
+        waitFlags(buttonFlags, BUTTON_PRESSES, FLAGS_ANY | FLAGS_CLEAR, &buttons);
         if ((buttons & 1) != 0)
         {
             YELLOW_LED ^= 1;
@@ -1122,53 +3410,196 @@ void readKeys()
         {
             setThreadPriority(lengthyFn, 4);
         }
+    }
+}
+
+void uncooperative()
+{
+    while(true)
+    {
+        while (readPbs() == 32)
+        {
+        }
         yield();
     }
 }
 
-void debounce()
+void important()
 {
-    uint8_t count;
     while(true)
     {
-        wait(keyPressed);
-        count = 10;
-        while (count != 0)
+        lock(resource);
+        BLUE_LED = 1;
+        sleep(1000);
+        BLUE_LED = 0;
+        unlock(resource);
+    }
+}
+
+#ifdef BENCHMARK
+// keep one sample, the paths measured are far below 0xFFFF cycles
+void benchStore(uint16_t i, uint32_t cycles)
+{
+    benchSamples[i] = (cycles > 0xFFFF) ? 0xFFFF : cycles;
+}
+
+// switch to the partner with a bare PendSV, rtosScheduler keeps the head of a
+// level so this task is moved behind the partner first, benchSample is
+// cleared so a switch that never happened shows up as a 0 cycle minimum
+void benchPendSV()
+{
+    __asm("     CPSID I");
+    readyRotate(taskCurrent);
+    benchSample = 0;
+    benchStartCycles = DWT_CYCCNT_R;
+    NVIC_INT_CTRL_R = NVIC_INT_CTRL_PEND_SV;
+    __asm("     CPSIE I");
+}
+
+// sort the samples of one test and store min/avg/p99/max, p99 is the
+// nearest rank ceil(0.99 * n)
+void benchCollect(uint8_t test)
+{
+    uint16_t i, j, sample;
+    uint32_t total = 0;
+    for (i = 1; i < benchIterations; i++)
+    {
+        sample = benchSamples[i];
+        for (j = i; j > 0 && benchSamples[j - 1] > sample; j--)
         {
-            sleep(10);
-            if (readPbs() == 0)
-                count--;
-            else
-                count = 10;
+            benchSamples[j] = benchSamples[j - 1];
         }
-        post(keyReleased);
+        benchSamples[j] = sample;
+    }
+    for (i = 0; i < benchIterations; i++)
+    {
+        total += benchSamples[i];
     }
+    benchResults[test].min = benchSamples[0];
+    benchResults[test].avg = total / benchIterations;
+    benchResults[test].max = benchSamples[benchIterations - 1];
+    benchResults[test].p99 = benchSamples[(benchIterations * 99 + 99) / 100 - 1];
 }
 
-void uncooperative()
+// runs the timed paths when the bench command posts benchStart
+// benchPartner shares priority 1 so round robin alternates the two tasks
+void benchMaster()
 {
+    uint16_t i;
     while(true)
     {
-        while (readPbs() == 32)
+        wait(benchStart);
+        // release the partner from benchPing into its yield loop
+        benchMode = BENCH_YIELD;
+        post(benchPing);
+        wait(benchPong);
+
+        for (i = 0; i < benchIterations; i++)
+        {
+            benchStartCycles = DWT_CYCCNT_R;
+            yield();
+            benchStore(i, DWT_CYCCNT_R - benchStartCycles);
+        }
+        benchCollect(BENCH_YIELD);
+
+        // one save/schedule/restore, the partner stamps when it resumes
+        benchMode = BENCH_PENDSV;
+        for (i = 0; i < benchIterations; i++)
+        {
+            benchPendSV();
+            benchStore(i, benchSample);
+        }
+        benchCollect(BENCH_PENDSV);
+
+        // same switch into a freshly restarted partner
+        benchMode = BENCH_UNRUN;
+        for (i = 0; i < benchIterations; i++)
         {
+            restartThread(benchPartner);
+            benchPendSV();
+            benchStore(i, benchSample);
         }
+        benchCollect(BENCH_UNRUN);
+
+        // let the partner leave its yield loop and block on benchPing
+        benchMode = BENCH_PINGPONG;
         yield();
+        for (i = 0; i < benchIterations; i++)
+        {
+            benchStartCycles = DWT_CYCCNT_R;
+            post(benchPing);
+            wait(benchPong);
+            benchStore(i, DWT_CYCCNT_R - benchStartCycles);
+        }
+        benchCollect(BENCH_PINGPONG);
+
+        // partner stays blocked so only the tick can wake this task
+        benchMode = BENCH_TICK;
+        for (i = 0; i < benchIterations; i++)
+        {
+            sleep(1);
+            benchStore(i, DWT_CYCCNT_R - benchTickCycles);
+        }
+        benchCollect(BENCH_TICK);
+
+        benchMode = BENCH_TESTS;
+        post(benchDone);
     }
 }
 
-void important()
+void benchPartner()
 {
+    uint32_t now = DWT_CYCCNT_R;
+    if (benchMode == BENCH_UNRUN)
+        benchSample = now - benchStartCycles;
     while(true)
     {
-        wait(resource);
-        BLUE_LED = 1;
-        sleep(1000);
-        BLUE_LED = 0;
-        post(resource);
+        if (benchMode == BENCH_YIELD || benchMode == BENCH_PENDSV || benchMode == BENCH_UNRUN)
+        {
+            yield();
+            benchSample = DWT_CYCCNT_R - benchStartCycles;
+        }
+        else
+        {
+            wait(benchPing);
+            post(benchPong);
+        }
     }
 }
+#endif
 
 // REQUIRED: add processing for the shell commands through the UART here
+// send finished log records as frames: LOG_SYNC then the record words,
+// little endian, records are cleared as they are taken off the ring
+void logger()
+{
+    char frame[1 + 6 * 4];
+    uint32_t word, n, k;
+    uint32_t dropped = 0;
+    while(true)
+    {
+        while (logTail != logHead && logRing[logTail & (LOG_SIZE - 1)] != 0)
+        {
+            n = (logRing[logTail & (LOG_SIZE - 1)] & 0xF) + 2;
+            frame[0] = LOG_SYNC;
+            for (k = 0; k < n; k++)
+            {
+                word = logRing[(logTail + k) & (LOG_SIZE - 1)];
+                logRing[(logTail + k) & (LOG_SIZE - 1)] = 0;
+                memcpy(&frame[1 + k * 4], &word, 4);
+            }
+            logTail += n;
+            uartWrite(frame, 1 + n * 4);
+        }
+        if (logDropped != dropped)
+        {
+            LOG1(LOG_DROPPED, logDropped - dropped);
+            dropped = logDropped;
+        }
+        sleep(LOG_PERIOD);
+    }
+}
+
 void shell()
 {
     while (true)
@@ -1193,7 +3624,8 @@ int main(void)
 
     // Setup UART0 baud rate
     setUart0BaudRate(115200, 40e6);
-    putsUart0("Hi Rtos");
+    initUartRings();
+    uartPuts("Hi Rtos");
 
     // Power-up flash
     GREEN_LED = 1;
@@ -1202,24 +3634,34 @@ int main(void)
     // waitMicrosecond(250000);
 
     // Initialize semaphores
-    createSemaphore(keyPressed, 1);
-    createSemaphore(keyReleased, 0);
-    createSemaphore(flashReq, 5);
-    createSemaphore(resource, 1);
+    createSemaphore(flashReq, 5, QUEUE_FIFO);
+    createMutex(resource, MUTEX_INHERIT, 0);
+#ifdef BENCHMARK
+    createSemaphore(benchStart, 0, QUEUE_FIFO);
+    createSemaphore(benchDone, 0, QUEUE_FIFO);
+    createSemaphore(benchPing, 0, QUEUE_FIFO);
+    createSemaphore(benchPong, 0, QUEUE_FIFO);
+#endif
 
     // Add required idle process at lowest priority
-    ok =  createThread(idle, "Idle", 7, 1024);
-    //ok &= createThread(idle2, "Idle2", 7, 1024);
+    ok =  createThread(idle, "Idle", 7, 768);
+    //ok &= createThread(idle2, "Idle2", 7, 768);
 
     // Add other processes
-    ok &= createThread(lengthyFn, "LengthyFn", 6, 1024);
-    ok &= createThread(flash4Hz, "Flash4Hz", 4, 1024);
-    ok &= createThread(oneshot, "OneShot", 2, 1024);
-    ok &= createThread(readKeys, "ReadKeys", 6, 1024);
-    ok &= createThread(debounce, "Debounce", 6, 1024);
-    ok &= createThread(important, "Important", 0, 1024);
-    ok &= createThread(uncooperative, "Uncoop", 6, 1024);
-    ok &= createThread(shell, "Shell", 6, 4096);
+    ok &= createThread(lengthyFn, "LengthyFn", 6, 768);
+    setThreadQuantum(lengthyFn, 10);
+    ok &= createPeriodicThread(flash4Hz, "Flash4Hz", 4, 768, 125, 125, 1);
+    ok &= createThread(oneshot, "OneShot", 2, 768);
+    ok &= createThread(readKeys, "ReadKeys", 6, 768);
+    ok &= createThread(important, "Important", 0, 768);
+    ok &= createThread(uncooperative, "Uncoop", 6, 768);
+    setThreadBudget(uncooperative, 10, 100, BUDGET_DEMOTE);
+    ok &= createThread(shell, "Shell", 6, 3072);
+    ok &= createThread(logger, "Logger", 7, 768);
+#ifdef BENCHMARK
+    ok &= createThread(benchMaster, "BenchMaster", 1, 768);
+    ok &= createThread(benchPartner, "BenchPartner", 1, 768);
+#endif
 
     // Start up RTOS
     if (ok)
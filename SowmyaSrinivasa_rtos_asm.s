@@ -6,11 +6,16 @@
 	.def setPSP
 	.def setASP
 	.def getPSP
-	.def pushReglist
-	.def popReglist
-	.def createHWpushContext
+	.def pendSVIsr
 	.def getSVCnumber
 	.def getR0
+	.def atomicReserve
+	.def mpuFaultIsr
+	.def pendSVDone
+
+	.ref taskSwitch
+	.ref scheduleNext
+	.ref mpuFault
 
 ;-----------------------------------------------------------------------------
 ; Subroutines
@@ -36,74 +41,46 @@ getPSP:
 				MRS R0, PSP
 				BX LR
 
-pushReglist:
-				MRS R0, PSP
-				SUB R0, #4
-				STR R4, [R0]
-				SUB R0, #4
-				STR R5, [R0]
-				SUB R0, #4
-				STR R6, [R0]
-				SUB R0, #4
-				STR R7, [R0]
-				SUB R0, #4
-				STR R8, [R0]
-				SUB R0, #4
-				STR R9, [R0]
-				SUB R0, #4
-				STR R10,[R0]
-				SUB R0, #4
-				STR R11,[R0]
-				MSR PSP, R0
-				BX LR
-
-popReglist:
-				MRS R0, PSP
-				LDR R11, [R0]
-				ADD R0, #4
-				LDR R10, [R0]
-				ADD R0, #4
-				LDR R9, [R0]
-				ADD R0, #4
-				LDR R8, [R0]
-				ADD R0, #4
-				LDR R7, [R0]
-				ADD R0, #4
-				LDR R6, [R0]
-				ADD R0, #4
-				LDR R5, [R0]
-				ADD R0, #4
-				LDR R4, [R0]
-				ADD R0, #4
-				MSR PSP, R0
-				BX LR
-
-createHWpushContext:
-			   MRS R4, PSP
-			   SUB R4, #4
-			   STR R0, [R4] ; XPSR
-			   SUB R4, #4
-			   STR R1, [R4]  ; PC
-			   SUB R4, #4
-			   STR R2, [R4]  ; other registers - LR
-			   SUB R4, #4
-			   ADD R2, #1
-			   STR R2, [R4]  ; R12
-			   SUB R4, #4
-			   ADD R2, #1
-			   STR R2, [R4]  ; R3
-			   SUB R4, #4
-			   ADD R2, #1
-			   STR R2, [R4]  ; R2
-			   SUB R4, #4
-			   ADD R2, #1
-			   STR R2, [R4]	 ; R1
-			   SUB R4, #4
-			   ADD R2, #1
-			   STR R2, [R4]	 ; R0
-			   MSR PSP, R4   ; PSP pointed back
+; PendSV handler, the whole context switch
+; hardware has stacked R0-R3, R12, LR, PC, xPSR on the PSP (plus S0-S15 and
+; FPSCR when the task used the FPU, reserved lazily)
+; EXC_RETURN bit 4 is clear only for tasks with FP state, so only they save
+; S16-S31, then R4-R11 and EXC_RETURN go below in one store
+; taskSwitch saves that sp in the tcb and returns the sp of the next task,
+; which is restored the same way in reverse
+; tasks that never ran have the same frame built by createThread
+; scheduleNext runs first and only touches caller-saved registers, when it
+; picks the running task again nothing is saved or restored at all
+pendSVIsr:
+			   PUSH {R0, LR}
+			   BL scheduleNext
+			   POP {R1, LR}
+			   CMP R0, #0
+			   BEQ pendSVDone
+			   MRS R0, PSP
+			   TST LR, #0x10
+			   IT EQ
+			   VSTMDBEQ R0!, {S16-S31}
+			   STMDB R0!, {R4-R11, LR}
+			   BL taskSwitch
+			   LDMIA R0!, {R4-R11, LR}
+			   TST LR, #0x10
+			   IT EQ
+			   VLDMIAEQ R0!, {S16-S31}
+			   MSR PSP, R0
+pendSVDone:
 			   BX LR
 
+; MemManage fault, mpuFault gets the stacked frame in R0 and EXC_RETURN in R1
+; the frame is on the PSP for a task and on the MSP when pendSVIsr faulted
+mpuFaultIsr:
+			   TST LR, #4
+			   ITE EQ
+			   MRSEQ R0, MSP
+			   MRSNE R0, PSP
+			   MOV R1, LR
+			   B mpuFault
+
 getSVCnumber:
 			   MRS R0, PSP
 			   ADD R0, #24
@@ -113,4 +90,29 @@ getSVCnumber:
 
 getR0:
 			   BX LR
+
+; reserve n slots of a ring shared by tasks and ISRs without masking interrupts
+; R0 = &head, R1 = n, R2 = tail, R3 = ring size, all counts free running
+; head advances by n only if head + n - tail still fits in the ring
+; returns the old head, or 0xFFFFFFFF if the ring is too full
+; an interrupt between LDREX and STREX makes the store fail and it retries
+atomicReserve:
+			   PUSH {R4, R5}
+reserveRetry:
+			   LDREX R12, [R0]
+			   ADD R4, R12, R1
+			   SUB R5, R4, R2
+			   CMP R5, R3
+			   BHI reserveFull
+			   STREX R5, R4, [R0]
+			   CMP R5, #0
+			   BNE reserveRetry
+			   MOV R0, R12
+			   POP {R4, R5}
+			   BX LR
+reserveFull:
+			   CLREX
+			   MVN R0, #0
+			   POP {R4, R5}
+			   BX LR
 .endm
@@ -0,0 +1,199 @@
+// Host port stand-in for the TI device header
+// SowmyaSrinivasa_rtos.c includes "tm4c123gh6pm.h" first, with -Ihost/port
+// this file takes its place: peripheral registers become plain words, the
+// hardware addresses the kernel defines itself are replaced (HOST_PORT) and
+// the few instructions the kernel issues go to hostAsm() in rtos_host.c
+// a register or bit the kernel starts using has to be added here as well
+
+#ifndef TM4C123GH6PM_HOST_H_
+#define TM4C123GH6PM_HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HOST_PORT
+
+// the kernel keeps pointers in 32-bit words (frames, pids), rtos_host.c keeps
+// every kernel pointer below 4 GiB
+#pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+
+// stack pool: rtos_host.c maps 256 KiB at 0x20000000 so the pool keeps the
+// target addresses and 32-bit pointers, host tasks need bigger stacks
+#define HEAP_END 0x20040000
+
+// instructions, interrupt masking and SVC are emulated, the rest are no-ops
+void hostAsm(const char *instruction);
+#define __asm(instruction) hostAsm(instruction)
+#define _delay_cycles(n)
+
+// the host supplies main() and its own tasks, the target's main is unused
+#define main rtosMain
+
+// kernel calls, the target implements them with SVC in the kernel source,
+// the host port passes the arguments to SVCIsr through an emulated frame
+void yield();
+void sleep(uint32_t tick);
+void wait(int8_t s);
+void post(int8_t s);
+void lock(int8_t m);
+void unlock(int8_t m);
+void getBuffer(void **buffer);
+void freeBuffer(void *buffer);
+void send(uint8_t box, void *msg);
+void receive(uint8_t box, void **msg);
+void waitFlags(uint8_t group, uint32_t mask, uint8_t options, uint32_t *result);
+void setFlags(uint8_t group, uint32_t mask);
+void sleepUntil(uint32_t *lastWake, uint32_t period);
+void initTaskFrame(uint8_t task);
+void initSystemClockTo40Mhz();
+
+// LEDs, pushbuttons (0 = pressed) and the DWT cycle counter, which runs
+// from the host clock at 40 MHz
+extern volatile uint32_t hostPins[11];
+uint32_t *hostCycles();
+#define BLUE_LED            hostPins[0]
+#define RED_LED             hostPins[1]
+#define GREEN_LED           hostPins[2]
+#define YELLOW_LED          hostPins[3]
+#define ORANGE_LED          hostPins[4]
+#define PUSH_BUTTON0        hostPins[5]
+#define PUSH_BUTTON1        hostPins[6]
+#define PUSH_BUTTON2        hostPins[7]
+#define PUSH_BUTTON3        hostPins[8]
+#define PUSH_BUTTON4        hostPins[9]
+#define PUSH_BUTTON5        hostPins[10]
+#define DWT_CYCCNT_R        (*hostCycles())
+#define CORE_DEMCR_TRCENA   0x01000000
+#define DWT_CTRL_CYCCNTENA  0x00000001
+
+// UART0 data and flags come from stdin, see uart0.c
+uint32_t *hostUartData();
+uint32_t *hostUartFlags();
+#define UART0_DR_R              (*hostUartData())
+#define UART0_FR_R              (*hostUartFlags())
+
+// peripheral registers
+extern volatile uint32_t hostRegisters[64];
+#define GPIO_PORTA_DEN_R        hostRegisters[0]
+#define GPIO_PORTA_DIR_R        hostRegisters[1]
+#define GPIO_PORTA_DR2R_R       hostRegisters[2]
+#define GPIO_PORTC_DEN_R        hostRegisters[3]
+#define GPIO_PORTC_DIR_R        hostRegisters[4]
+#define GPIO_PORTC_IBE_R        hostRegisters[5]
+#define GPIO_PORTC_ICR_R        hostRegisters[6]
+#define GPIO_PORTC_IM_R         hostRegisters[7]
+#define GPIO_PORTC_IS_R         hostRegisters[8]
+#define GPIO_PORTC_PUR_R        hostRegisters[9]
+#define GPIO_PORTD_CR_R         hostRegisters[10]
+#define GPIO_PORTD_DEN_R        hostRegisters[11]
+#define GPIO_PORTD_DIR_R        hostRegisters[12]
+#define GPIO_PORTD_IBE_R        hostRegisters[13]
+#define GPIO_PORTD_ICR_R        hostRegisters[14]
+#define GPIO_PORTD_IM_R         hostRegisters[15]
+#define GPIO_PORTD_IS_R         hostRegisters[16]
+#define GPIO_PORTD_LOCK_R       hostRegisters[17]
+#define GPIO_PORTD_PUR_R        hostRegisters[18]
+#define GPIO_PORTE_DEN_R        hostRegisters[19]
+#define GPIO_PORTE_DIR_R        hostRegisters[20]
+#define GPIO_PORTE_DR2R_R       hostRegisters[21]
+#define GPIO_PORTF_DEN_R        hostRegisters[22]
+#define GPIO_PORTF_DIR_R        hostRegisters[23]
+#define GPIO_PORTF_DR2R_R       hostRegisters[24]
+#define NVIC_APINT_R            hostRegisters[25]
+#define NVIC_CPAC_R             hostRegisters[26]
+#define NVIC_EN0_R              hostRegisters[27]
+#define NVIC_FAULT_STAT_R       hostRegisters[28]
+#define NVIC_FPCC_R             hostRegisters[29]
+#define NVIC_INT_CTRL_R         hostRegisters[30]
+#define NVIC_MM_ADDR_R          hostRegisters[31]
+#define NVIC_MPU_ATTR_R         hostRegisters[32]
+#define NVIC_MPU_BASE_R         hostRegisters[33]
+#define NVIC_MPU_CTRL_R         hostRegisters[34]
+#define NVIC_ST_CTRL_R          hostRegisters[35]
+#define NVIC_ST_CURRENT_R       hostRegisters[36]
+#define NVIC_ST_RELOAD_R        hostRegisters[37]
+#define NVIC_SYS_HND_CTRL_R     hostRegisters[38]
+#define SYSCTL_RCGCDMA_R        hostRegisters[39]
+#define SYSCTL_RCGCGPIO_R       hostRegisters[40]
+#define UART0_DMACTL_R          hostRegisters[41]
+#define UART0_ICR_R             hostRegisters[44]
+#define UART0_IM_R              hostRegisters[45]
+#define UDMA_ALTCLR_R           hostRegisters[46]
+#define UDMA_CFG_R              hostRegisters[47]
+#define UDMA_CHIS_R             hostRegisters[48]
+#define UDMA_CHMAP1_R           hostRegisters[49]
+#define UDMA_CTLBASE_R          hostRegisters[50]
+#define UDMA_ENASET_R           hostRegisters[51]
+#define UDMA_PRIOCLR_R          hostRegisters[52]
+#define UDMA_REQMASKCLR_R       hostRegisters[53]
+#define UDMA_USEBURSTCLR_R      hostRegisters[54]
+#define CORE_DEMCR_R            hostRegisters[55]
+#define DWT_CTRL_R              hostRegisters[56]
+#define NVIC_SYS_PRI1_R         hostRegisters[57]
+#define NVIC_SYS_PRI2_R         hostRegisters[58]
+#define NVIC_SYS_PRI3_R         hostRegisters[59]
+#define NVIC_PRI4_R             hostRegisters[60]
+#define NVIC_PRI5_R             hostRegisters[61]
+
+// register bits, same values as the TI header
+#define INT_GPIOC               18
+#define INT_GPIOD               19
+#define INT_UART0               21
+#define NVIC_APINT_SYSRESETREQ  0x00000004
+#define NVIC_APINT_VECTKEY      0x05FA0000
+#define NVIC_CPAC_CP10_FULL     0x00300000
+#define NVIC_CPAC_CP11_FULL     0x00C00000
+#define NVIC_FAULT_STAT_MMARV   0x00000080
+#define NVIC_FPCC_ASPEN         0x80000000
+#define NVIC_FPCC_LSPEN         0x40000000
+#define NVIC_INT_CTRL_PEND_SV   0x10000000
+#define NVIC_INT_CTRL_PENDSTSET 0x04000000
+#define NVIC_MPU_ATTR_ENABLE    0x00000001
+#define NVIC_MPU_ATTR_XN        0x10000000
+#define NVIC_MPU_BASE_VALID     0x00000010
+#define NVIC_MPU_CTRL_ENABLE    0x00000001
+#define NVIC_MPU_CTRL_PRIVDEFEN 0x00000004
+#define NVIC_PRI4_INT18_M       0x00E00000
+#define NVIC_PRI4_INT18_S       21
+#define NVIC_PRI4_INT19_M       0xE0000000
+#define NVIC_PRI4_INT19_S       29
+#define NVIC_PRI5_INT21_M       0x0000E000
+#define NVIC_PRI5_INT21_S       13
+#define NVIC_ST_CTRL_CLK_SRC    0x00000004
+#define NVIC_ST_CTRL_COUNT      0x00010000
+#define NVIC_ST_CTRL_ENABLE     0x00000001
+#define NVIC_ST_CTRL_INTEN      0x00000002
+#define NVIC_SYS_HND_CTRL_MEM   0x00010000
+#define NVIC_SYS_PRI1_MEM_M     0x000000E0
+#define NVIC_SYS_PRI1_USAGE_M   0x00E00000
+#define NVIC_SYS_PRI2_SVC_M     0xE0000000
+#define NVIC_SYS_PRI2_SVC_S     29
+#define NVIC_SYS_PRI3_PENDSV_M  0x00E00000
+#define NVIC_SYS_PRI3_PENDSV_S  21
+#define NVIC_SYS_PRI3_TICK_M    0xE0000000
+#define NVIC_SYS_PRI3_TICK_S    29
+#define NVIC_SYS_HND_CTRL_USAGE 0x00040000
+#define SYSCTL_RCGCDMA_R0       0x00000001
+#define SYSCTL_RCGCGPIO_R0      0x00000001
+#define SYSCTL_RCGCGPIO_R2      0x00000004
+#define SYSCTL_RCGCGPIO_R3      0x00000008
+#define SYSCTL_RCGCGPIO_R4      0x00000010
+#define SYSCTL_RCGCGPIO_R5      0x00000020
+#define UART_DMACTL_TXDMAE      0x00000002
+#define UART_FR_RXFE            0x00000010
+#define UART_ICR_RTIC           0x00000040
+#define UART_ICR_RXIC           0x00000010
+#define UART_IM_RTIM            0x00000040
+#define UART_IM_RXIM            0x00000010
+#define UDMA_CFG_MASTEN         0x00000001
+#define UDMA_CHCTL_ARBSIZE_4    0x00008000
+#define UDMA_CHCTL_DSTINC_NONE  0xC0000000
+#define UDMA_CHCTL_DSTSIZE_8    0x00000000
+#define UDMA_CHCTL_SRCINC_8     0x00000000
+#define UDMA_CHCTL_SRCSIZE_8    0x00000000
+#define UDMA_CHCTL_XFERMODE_BASIC 0x00000001
+#define UDMA_CHCTL_XFERSIZE_S   4
+#define UDMA_CHMAP1_CH9SEL_M    0x000000F0
+
+#endif
@@ -0,0 +1,74 @@
+// Host port stand-in for UART0 and its uDMA channel, on stdio
+// Included by rtos_host.c after the kernel:
+//   tx -> uartTxKick() writes the buffer being filled to stdout and the
+//         transfer is complete at once, so txBusy is never set and writers
+//         never wait for room
+//   rx -> UART0_DR_R and UART0_FR_R read from stdin, hostUartPoll() runs
+//         uart0ISR() from the tick whenever input is waiting, a newline is
+//         passed on as the CR the shell ends its lines with
+
+#include <poll.h>
+
+// unistd.h also declares sleep(), so read() is declared here
+extern long read(int fd, void *buffer, unsigned long count);
+
+char hostRx[64];               // stdin bytes not taken by uart0ISR yet
+uint8_t hostRxCount = 0, hostRxNext = 0;
+uint32_t hostUartWord;         // what the last UART0_FR_R or UART0_DR_R read returns
+
+void initUart0()
+{
+}
+
+void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc)
+{
+    (void)baudRate;
+    (void)fcyc;
+}
+
+// called with interrupts off like the target's, the buffer goes out now and
+// writers keep filling the same one
+void uartTxKick()
+{
+    uint16_t n = txCount[txFill];
+    if (n == 0)
+        return;
+    fwrite(uartTx[txFill], 1, n, stdout);
+    fflush(stdout);
+    txCount[txFill] = 0;
+}
+
+uint32_t *hostUartFlags()
+{
+    hostUartWord = (hostRxNext < hostRxCount) ? 0 : UART_FR_RXFE;
+    return &hostUartWord;
+}
+
+uint32_t *hostUartData()
+{
+    hostUartWord = 0;
+    if (hostRxNext < hostRxCount)
+    {
+        hostUartWord = (uint8_t)hostRx[hostRxNext++];
+        if (hostUartWord == '\n')
+            hostUartWord = 13;
+    }
+    return &hostUartWord;
+}
+
+// the rx interrupt: take what stdin has without blocking
+void hostUartPoll()
+{
+    struct pollfd input;
+    long n;
+    input.fd = 0;
+    input.events = POLLIN;
+    if (poll(&input, 1, 0) != 1 || !(input.revents & POLLIN))
+        return;
+    n = read(0, hostRx, sizeof(hostRx));
+    if (n <= 0)
+        return;
+    hostRxCount = n;
+    hostRxNext = 0;
+    uart0ISR();
+}
@@ -0,0 +1,13 @@
+// Host port stand-in for the UART0 library, the kernel drives UART0 itself,
+// uart0.c puts its tx buffers and rx interrupt on stdio
+
+#ifndef UART0_H_
+#define UART0_H_
+
+#include <stdint.h>
+
+void initUart0();
+void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc);
+void uartTxKick();
+
+#endif
@@ -0,0 +1,11 @@
+// Host port stand-in for the busy wait library, the idle task's wait is
+// where the host port advances its clock
+
+#ifndef WAIT_H_
+#define WAIT_H_
+
+#include <stdint.h>
+
+void waitMicrosecond(uint32_t us);
+
+#endif
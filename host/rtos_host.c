@@ -0,0 +1,543 @@
+// Host simulation port of the RTOS kernel
+// Builds SowmyaSrinivasa_rtos.c itself as a Linux process, so the scheduler,
+// sleep, semaphore and every other kernel path measured here are the ones
+// that ship on the target
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux, x86-64
+// Build:           gcc -O2 -no-pie -Ihost/port -o rtos_host host/rtos_host.c
+// Run:             ./rtos_host [-n iterations] [-t] [-s]
+//   -n  benchmark iterations (default 10000)
+//   -t  drive the tick from SIGALRM every 1ms instead of the virtual clock
+//   -s  run the kernel's shell on stdin/stdout instead of the benchmark
+
+// Port layer:
+//   host/port/*.h  -> stand-ins for the TI headers, registers are plain words
+//   SVC            -> hostSvc() fills an emulated frame and calls SVCIsr()
+//   PendSV         -> pendSVIsr() below, same scheduleNext/taskSwitch calls
+//                     as the target's, switching the host stack pointer
+//   SysTick        -> systickIsr() from SIGALRM, or from the idle task's
+//                     waitMicrosecond() on the virtual clock so runs are
+//                     reproducible
+//   CPSID/CPSIE    -> block/unblock SIGALRM, CPSIE takes a pending PendSV
+//   UART0          -> stdio, port/uart0.c
+// The kernel passes pointers through 32-bit frame words, so the port needs a
+// non-PIE build (globals below 4 GiB) and maps the stack pool at the
+// target's addresses
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+// _DEFAULT_SOURCE and not _GNU_SOURCE, which pulls in unistd.h and its
+// sleep() that clashes with the kernel call
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+// the kernel, unchanged, and UART0 on stdio
+#include "../SowmyaSrinivasa_rtos.c"
+#undef main
+#include "uart0.c"
+
+#if !defined(__x86_64__)
+#error "the host port switches stacks with x86-64 code"
+#endif
+
+//-----------------------------------------------------------------------------
+// Port state
+//-----------------------------------------------------------------------------
+
+#define POOL_BASE  0x20000000          // SRAM base, the pool starts at HEAP_BASE
+#define HOST_STACK 16384               // host library calls need more stack than the target tasks
+
+volatile uint32_t hostRegisters[64];
+volatile uint32_t hostPins[11];
+bool signalTick = false;       // tick from SIGALRM instead of the virtual clock
+bool shellMode = false;        // shell and kernel bench tasks instead of the host bench
+bool hostInIsr = false;        // kernel entered through an emulated exception
+sigset_t tickSignal;
+uint32_t hostFrame[8];         // R0-R3, R12, LR, PC, xPSR as SVCIsr reads them
+uint32_t hostSvcNumber;        // immediate of the emulated SVC
+void *hostPsp;                 // what getPSP() returns
+
+void pendSVIsr();
+void taskEntry();
+
+//-----------------------------------------------------------------------------
+// Context switch
+//-----------------------------------------------------------------------------
+
+// pendSVIsr: same steps as the target's, scheduleNext first and nothing is
+// saved when it keeps the running task, otherwise the callee-saved registers
+// go on the task's stack and taskSwitch trades its sp for the next task's
+// setASP(2): the target switches thread mode to PSP and startRtos calls the
+// first task, here it moves to the PSP set before and enters the task
+__asm__(
+    "    .text\n"
+    "    .globl pendSVIsr\n"
+    "pendSVIsr:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq  $8, %rsp\n"
+    "    call  scheduleNext\n"
+    "    testb %al, %al\n"
+    "    jz    pendSVDone\n"
+    "    movq  %rsp, %rdi\n"
+    "    call  taskSwitch\n"
+    "    movq  %rax, %rsp\n"
+    "    .globl pendSVDone\n"
+    "pendSVDone:\n"
+    "    addq  $8, %rsp\n"
+    "    popq  %r15\n"
+    "    popq  %r14\n"
+    "    popq  %r13\n"
+    "    popq  %r12\n"
+    "    popq  %rbx\n"
+    "    popq  %rbp\n"
+    "    ret\n"
+    "    .globl setASP\n"
+    "setASP:\n"
+    "    movq  hostPsp(%rip), %rsp\n"
+    "    andq  $-16, %rsp\n"
+    "    call  taskEntry\n"
+    "    ud2\n");
+
+// frame a never-run task is first switched to, as pendSVIsr leaves it
+void initTaskFrame(uint8_t task)
+{
+    uint64_t *sp = tcb[task].spInit;
+    *--sp = 0;                         // keeps rsp 16-byte aligned + 8 at entry
+    *--sp = (uint64_t)taskEntry;       // return address of pendSVIsr
+    sp -= 7;                           // rbp, rbx, r12-r15 and the alignment pad
+    memset(sp, 0, 7 * sizeof(uint64_t));
+    tcb[task].sp = sp;
+}
+
+//-----------------------------------------------------------------------------
+// Exceptions and instructions
+//-----------------------------------------------------------------------------
+
+void blockTick()
+{
+    if (signalTick)
+        sigprocmask(SIG_BLOCK, &tickSignal, NULL);
+}
+
+void unblockTick()
+{
+    if (signalTick)
+        sigprocmask(SIG_UNBLOCK, &tickSignal, NULL);
+}
+
+// PendSV runs when the kernel leaves an exception or unmasks interrupts
+void hostPendSV()
+{
+    if (NVIC_INT_CTRL_R & NVIC_INT_CTRL_PEND_SV)
+    {
+        NVIC_INT_CTRL_R &= ~NVIC_INT_CTRL_PEND_SV;
+        pendSVIsr();
+    }
+}
+
+void hostAsm(const char *instruction)
+{
+    while (*instruction == ' ')
+        instruction++;
+    if (strncmp(instruction, "CPSID", 5) == 0)
+    {
+        if (!hostInIsr)
+            blockTick();
+    }
+    else if (strncmp(instruction, "CPSIE", 5) == 0)
+    {
+        if (!hostInIsr)
+        {
+            hostInIsr = true;
+            hostPendSV();
+            hostInIsr = false;
+            unblockTick();
+        }
+    }
+    else if (strncmp(instruction, "SVC", 3) == 0)
+    {
+        fprintf(stderr, "SVC outside the kernel call wrappers\n");
+        abort();
+    }
+    // WFI, ISB and DSB have nothing to do here
+}
+
+// frame words are 32 bits like on the target
+uint32_t hostWord(const void *p)
+{
+    if ((uintptr_t)p > 0xFFFFFFFF)
+    {
+        fprintf(stderr, "kernel pointer above 4 GiB, build with -no-pie\n");
+        abort();
+    }
+    return (uintptr_t)p;
+}
+
+// SVC: the arguments are stacked where SVCIsr reads R0-R3
+void hostSvc(uint8_t svc, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+    blockTick();
+    hostInIsr = true;
+    hostFrame[0] = r0;
+    hostFrame[1] = r1;
+    hostFrame[2] = r2;
+    hostFrame[3] = r3;
+    hostSvcNumber = svc;
+    hostPsp = hostFrame;
+    SVCIsr();
+    hostPendSV();
+    hostInIsr = false;
+    unblockTick();
+}
+
+// SysTick, signals are already blocked in the SIGALRM handler
+// UART0 rx is polled here, its interrupt runs first like a pending one would
+void hostTick()
+{
+    hostInIsr = true;
+    hostUartPoll();
+    systickIsr();
+    hostPendSV();
+    hostInIsr = false;
+}
+
+void tickSignalHandler(int signal)
+{
+    (void)signal;
+    hostTick();
+}
+
+// first code run by every task, equivalent of the hw frame PC
+void taskEntry()
+{
+    hostInIsr = false;
+    unblockTick();
+    tcb[taskCurrent].pFn();
+}
+
+void setPSP(void *sp)
+{
+    hostPsp = sp;
+}
+
+void *getPSP()
+{
+    return hostPsp;
+}
+
+void *getSVCnumber()
+{
+    return &hostSvcNumber;
+}
+
+int getR0()
+{
+    return hostFrame[0];
+}
+
+uint32_t atomicReserve(volatile uint32_t *head, uint32_t n, uint32_t tail, uint32_t size)
+{
+    uint32_t old = *head;
+    do
+    {
+        if (old + n - tail > size)
+            return 0xFFFFFFFF;
+    } while (!__atomic_compare_exchange_n(head, &old, old + n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return old;
+}
+
+uint32_t *hostCycles()
+{
+    static uint32_t cycles;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    cycles = (uint64_t)t.tv_sec * 40000000ull + t.tv_nsec / 25;
+    return &cycles;
+}
+
+// the idle task waits here with tickless idle off: on the virtual clock it
+// skips to the tick before the first sleeper's deadline and takes that tick
+void waitMicrosecond(uint32_t us)
+{
+    struct timespec t;
+    if (signalTick)
+    {
+        t.tv_sec = 0;
+        t.tv_nsec = us * 1000;
+        nanosleep(&t, NULL);
+        return;
+    }
+    blockTick();
+    if (sleepHead != NO_TASK && tcb[sleepHead].ticks > 1)
+        stepTicks(tcb[sleepHead].ticks - 1);
+    hostTick();
+}
+
+void initSystemClockTo40Mhz()
+{
+}
+
+//-----------------------------------------------------------------------------
+// Kernel calls
+//-----------------------------------------------------------------------------
+
+void yield()
+{
+    hostSvc(YIELD, 0, 0, 0, 0);
+}
+
+void sleep(uint32_t tick)
+{
+    hostSvc(SLEEP, tick, 0, 0, 0);
+}
+
+void wait(int8_t s)
+{
+    hostSvc(WAIT, s, 0, 0, 0);
+}
+
+void post(int8_t s)
+{
+    hostSvc(POST, s, 0, 0, 0);
+}
+
+void lock(int8_t m)
+{
+    hostSvc(LOCK, m, 0, 0, 0);
+}
+
+void unlock(int8_t m)
+{
+    hostSvc(UNLOCK, m, 0, 0, 0);
+}
+
+void getBuffer(void **buffer)
+{
+    hostSvc(GETBUF, hostWord(buffer), 0, 0, 0);
+}
+
+void freeBuffer(void *buffer)
+{
+    hostSvc(FREEBUF, hostWord(buffer), 0, 0, 0);
+}
+
+void send(uint8_t box, void *msg)
+{
+    hostSvc(SEND, box, hostWord(msg), 0, 0);
+}
+
+void receive(uint8_t box, void **msg)
+{
+    hostSvc(RECEIVE, box, hostWord(msg), 0, 0);
+}
+
+void waitFlags(uint8_t group, uint32_t mask, uint8_t options, uint32_t *result)
+{
+    hostSvc(WAITFLAGS, group, mask, options, hostWord(result));
+}
+
+void setFlags(uint8_t group, uint32_t mask)
+{
+    hostSvc(SETFLAGS, group, mask, 0, 0);
+}
+
+void sleepUntil(uint32_t *lastWake, uint32_t period)
+{
+    hostSvc(SLEEPUNTIL, hostWord(lastWake), period, 0, 0);
+}
+
+//-----------------------------------------------------------------------------
+// Benchmark
+//-----------------------------------------------------------------------------
+
+#define HOST_SLEEP 2           // third host test, after BENCH_YIELD and the ping-pong
+const char *hostBenchNames[3] = {"yield round trip", "post/wait ping-pong", "sleep(1) wake"};
+uint32_t hostIterations = 10000;
+uint64_t *hostSamples;
+
+uint64_t nowNs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void benchReport(uint8_t test)
+{
+    uint64_t total = 0;
+    uint32_t i;
+    for (i = 0; i < hostIterations; i++)
+        total += hostSamples[i];
+    qsort(hostSamples, hostIterations, sizeof(uint64_t), compareSamples);
+    printf("%-22s min %6llu  avg %6llu  p99 %6llu  max %8llu ns\n", hostBenchNames[test],
+           (unsigned long long)hostSamples[0],
+           (unsigned long long)(total / hostIterations),
+           (unsigned long long)hostSamples[(hostIterations * 99 + 99) / 100 - 1],
+           (unsigned long long)hostSamples[hostIterations - 1]);
+}
+
+// times each path from this task, the partner sits at the same priority
+void hostBenchMaster()
+{
+    uint32_t i;
+    uint64_t t0;
+    benchMode = BENCH_YIELD;
+    for (i = 0; i < hostIterations; i++)
+    {
+        t0 = nowNs();
+        yield();
+        hostSamples[i] = nowNs() - t0;
+    }
+    benchReport(0);
+
+    benchMode = BENCH_PINGPONG;
+    yield();
+    for (i = 0; i < hostIterations; i++)
+    {
+        t0 = nowNs();
+        post(benchPing);
+        wait(benchPong);
+        hostSamples[i] = nowNs() - t0;
+    }
+    benchReport(1);
+
+    for (i = 0; i < hostIterations; i++)
+    {
+        t0 = nowNs();
+        sleep(1);
+        hostSamples[i] = nowNs() - t0;
+    }
+    benchReport(HOST_SLEEP);
+    if (signalTick)
+        printf("ticks %u\n", tickCount);
+    else
+        printf("virtual ticks %u, suppressed %u\n", tickCount, suppressedTicks);
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
+
+void hostBenchPartner()
+{
+    while (true)
+    {
+        if (benchMode == BENCH_PINGPONG)
+        {
+            wait(benchPing);
+            post(benchPong);
+        }
+        else
+        {
+            yield();
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+    bool ok;
+    int i;
+    struct sigaction action;
+    struct itimerval period;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            hostIterations = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0)
+            signalTick = true;
+        else if (strcmp(argv[i], "-s") == 0)
+            shellMode = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-n iterations] [-t] [-s]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (hostIterations == 0)
+        hostIterations = 1;
+    hostSamples = malloc(hostIterations * sizeof(uint64_t));
+
+    // task stacks come from the kernel's pool at the target's addresses
+    if (mmap((void *)POOL_BASE, HEAP_END - POOL_BASE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)POOL_BASE)
+    {
+        perror("stack pool");
+        return EXIT_FAILURE;
+    }
+    for (i = 5; i < 11; i++)
+        hostPins[i] = 1;                   // buttons released
+
+    sigemptyset(&tickSignal);
+    sigaddset(&tickSignal, SIGALRM);
+    initRtos();
+    // SysTick is not emulated, the idle task's wait drives the clock instead
+    tickless = false;
+    createSemaphore(benchPing, 0, QUEUE_FIFO);
+    createSemaphore(benchPong, 0, QUEUE_FIFO);
+
+    ok =  createThread(idle, "Idle", 7, HOST_STACK);
+    if (shellMode)
+    {
+        // the bench command runs the target's own benchmark tasks
+        initUartRings();
+        createSemaphore(benchStart, 0, QUEUE_FIFO);
+        createSemaphore(benchDone, 0, QUEUE_FIFO);
+        createMutex(resource, MUTEX_INHERIT, 0);
+        ok &= createThread(shell, "Shell", 6, HOST_STACK);
+        ok &= createThread(benchMaster, "BenchMaster", 1, HOST_STACK);
+        ok &= createThread(benchPartner, "BenchPartner", 1, HOST_STACK);
+    }
+    else
+    {
+        ok &= createThread(hostBenchMaster, "BenchMaster", 1, HOST_STACK);
+        ok &= createThread(hostBenchPartner, "BenchPartner", 1, HOST_STACK);
+    }
+
+    if (signalTick)
+    {
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = tickSignalHandler;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGALRM, &action, NULL);
+        // the first task unmasks the tick once it runs on its own stack
+        blockTick();
+        period.it_interval.tv_sec = 0;
+        period.it_interval.tv_usec = 1000;
+        period.it_value = period.it_interval;
+        setitimer(ITIMER_REAL, &period, NULL);
+    }
+
+    if (ok && hostSamples != NULL)
+        startRtos(); // never returns
+    fprintf(stderr, "could not create tasks\n");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Decode the RTOS deferred log from a UART capture.
+
+Shell text passes through unchanged. Log frames (LOG_SYNC, then the record
+words little endian) are formatted with the strings taken from the LOG_*
+defines in the kernel source:
+
+    #define LOG_CREATE      2   // "thread %u created, pid %u, ..."
+
+usage: logdecode.py [-s SowmyaSrinivasa_rtos.c] [capture]   (stdin if omitted)
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+LOG_SYNC = 0xA5
+DEFINE = re.compile(r'#define\s+(LOG_\w+)\s+(\d+)\s*//\s*"(.*)"')
+
+
+def load_formats(path):
+    formats = {}
+    with open(path) as f:
+        for line in f:
+            m = DEFINE.match(line.strip())
+            if m:
+                formats[int(m.group(2))] = (m.group(1), m.group(3))
+    return formats
+
+
+def format_record(formats, header, tick, args):
+    task = (header >> 16) & 0xFF
+    ident = (header >> 8) & 0xFF
+    if ident not in formats:
+        text = 'unknown log id %d args %s' % (ident, ' '.join('0x%08x' % a for a in args))
+    else:
+        name, fmt = formats[ident]
+        # %d is signed on the target, the words arrive unsigned
+        values = tuple(a - (1 << 32) if a & 0x80000000 else a for a in args) \
+            if '%d' in fmt else tuple(args)
+        try:
+            text = fmt.replace('%u', '%d') % values
+        except (TypeError, ValueError):
+            text = '%s %s' % (name, ' '.join('0x%08x' % a for a in args))
+    return '[%10u ms] task %2u: %s' % (tick, task, text)
+
+
+def decode(formats, data, out):
+    i = 0
+    while i < len(data):
+        byte = data[i]
+        if byte != LOG_SYNC:
+            out.write(chr(byte))
+            i += 1
+            continue
+        if i + 9 > len(data):
+            break
+        header, tick = struct.unpack_from('<II', data, i + 1)
+        count = header & 0xF
+        if not header & 0x80000000 or count > 4 or i + 9 + 4 * count > len(data):
+            # not a frame after all
+            out.write('\\x%02x' % byte)
+            i += 1
+            continue
+        args = struct.unpack_from('<%dI' % count, data, i + 9)
+        out.write('\n' + format_record(formats, header, tick, args) + '\n')
+        i += 9 + 4 * count
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description='decode the RTOS deferred log')
+    parser.add_argument('-s', '--source',
+                        default=os.path.join(here, '..', 'SowmyaSrinivasa_rtos.c'),
+                        help='kernel source with the LOG_* format defines')
+    parser.add_argument('capture', nargs='?', help='raw UART capture, stdin if omitted')
+    args = parser.parse_args()
+
+    formats = load_formats(args.source)
+    if args.capture:
+        with open(args.capture, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+    decode(formats, data, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Convert the RTOS trace shell dump into Chrome trace JSON.
+
+Capture the UART output of the `trace` command (built with TRACE defined)
+and convert it, then open the result in chrome://tracing or ui.perfetto.dev:
+
+    trace2chrome.py capture.txt > trace.json
+
+Each task is a thread in the timeline with its running slices, SVC calls and
+semaphore block/unblock events as instants, and ticks on a SysTick track.
+"""
+
+import argparse
+import json
+import sys
+
+TRACE_SWITCH, TRACE_SVC, TRACE_BLOCK, TRACE_UNBLOCK, TRACE_TICK = range(5)
+SYSTICK_TID = 1000
+# the SVC numbers defined next to YIELD in SowmyaSrinivasa_rtos.c
+SVC_NAMES = {16: 'yield', 32: 'sleep', 64: 'post', 128: 'wait', 17: 'lock',
+             18: 'unlock', 19: 'getBuffer', 20: 'freeBuffer', 21: 'send',
+             22: 'receive', 23: 'waitFlags', 24: 'setFlags', 25: 'sleepUntil'}
+
+
+def parse(lines):
+    """Return (clock, {task: name}, [(cycles, type, task, arg)]) of the last dump."""
+    clock, names, events = 40000000, {}, []
+    inside = False
+    for line in lines:
+        words = line.strip().lstrip('>').split()
+        if words[:2] == ['trace', 'begin']:
+            inside, names, events = True, {}, []
+        elif words[:2] == ['trace', 'end']:
+            inside = False
+        elif not inside or not words:
+            continue
+        elif words[0] == 'clock':
+            clock = int(words[1])
+        elif words[0] == 'task':
+            names[int(words[1])] = ' '.join(words[2:])
+        elif len(words) == 4 and all(w.isdigit() for w in words):
+            events.append(tuple(int(w) for w in words))
+    return clock, names, events
+
+
+def convert(clock, names, events):
+    out = [{'ph': 'M', 'name': 'process_name', 'pid': 0, 'args': {'name': 'RTOS'}},
+           {'ph': 'M', 'name': 'thread_name', 'pid': 0, 'tid': SYSTICK_TID,
+            'args': {'name': 'SysTick'}}]
+    for task, name in sorted(names.items()):
+        out.append({'ph': 'M', 'name': 'thread_name', 'pid': 0, 'tid': task,
+                    'args': {'name': '%s (%d)' % (name, task)}})
+
+    def name_of(task):
+        return names.get(task, 'task %d' % task)
+
+    # CYCCNT wraps every 2^32 cycles, the dump is in time order
+    base, last = 0, None
+    running, since = None, None
+    for cycles, kind, task, arg in events:
+        if last is not None and cycles < last:
+            base += 1 << 32
+        last = cycles
+        ts = (base + cycles) * 1e6 / clock
+        if kind == TRACE_SWITCH:
+            if since is None:
+                since = ts
+            if running is not None and ts > since:
+                out.append({'ph': 'X', 'name': name_of(running), 'pid': 0, 'tid': running,
+                            'ts': since, 'dur': ts - since})
+            running, since = arg, ts
+        elif kind == TRACE_SVC:
+            out.append({'ph': 'i', 's': 't', 'pid': 0, 'tid': task, 'ts': ts,
+                        'name': 'SVC %s' % SVC_NAMES.get(arg, arg)})
+        elif kind == TRACE_BLOCK:
+            out.append({'ph': 'i', 's': 't', 'pid': 0, 'tid': task, 'ts': ts,
+                        'name': 'block on semaphore %d' % arg})
+        elif kind == TRACE_UNBLOCK:
+            out.append({'ph': 'i', 's': 't', 'pid': 0, 'tid': task, 'ts': ts,
+                        'name': 'unblocked by semaphore %d' % arg})
+        elif kind == TRACE_TICK:
+            out.append({'ph': 'i', 's': 't', 'pid': 0, 'tid': SYSTICK_TID, 'ts': ts,
+                        'name': 'tick', 'args': {'running': name_of(task)}})
+    return {'traceEvents': out, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='convert an RTOS trace dump to Chrome trace JSON')
+    parser.add_argument('capture', nargs='?', help='text captured from the shell, stdin if omitted')
+    args = parser.parse_args()
+    if args.capture:
+        with open(args.capture, errors='replace') as f:
+            lines = f.readlines()
+    else:
+        lines = sys.stdin.readlines()
+    clock, names, events = parse(lines)
+    if not events:
+        sys.exit('no trace dump found')
+    json.dump(convert(clock, names, events), sys.stdout, indent=1)
+    sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()